@@ -0,0 +1,960 @@
+/*
+ * Benchmarks for mtojson
+ *
+ * Every workload is a descriptor which is generated repeatedly. The number of
+ * calls per run is calibrated to take at least the given time, the fastest of
+ * all runs is reported, so results of different builds are comparable.
+ *
+ * Output is CSV, or JSON with -j, one record per workload:
+ * workload, length of the JSON text, ns per call, MB/s and documents/s.
+ * All input data is generated from a fixed seed.
+ *
+ * Some workloads have a baseline which produces the same text with snprintf(),
+ * as hand-written serialization code would. Its ns per call and the speedup of
+ * json_generate() are added to the record. A baseline producing different text
+ * is an error.
+ *
+ * With -p hardware performance counters are read during another run of
+ * json_generate() on Linux and reported per byte of JSON text. Counters which
+ * are not available, e.g. in containers or VMs, are left empty.
+ *
+ * With -l the latency of every single call is recorded after a warm up in a
+ * log-linear histogram instead, and percentiles are reported. -c pins the
+ * benchmark to a CPU.
+ *
+ * With -m the workloads are generated on 1 to the given number of threads
+ * concurrently, each into its own buffer, and the throughput and the scaling
+ * efficiency are reported. Every document is compared with the expected text,
+ * to detect state shared between the threads. -s places the buffers of
+ * neighbouring threads into the same cache lines to show false sharing, -c
+ * pins the threads to consecutive CPUs.
+ */
+
+/*
+ * SPDX-License-Identifier: BSD-2-Clause
+ * This file is Copyright (c) 2020, 2021 by Rene Kita
+ */
+
+#define _GNU_SOURCE
+
+#include "mtojson.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sched.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+enum {
+	MAXLEN = 1 << 20,
+	MAXWORKLOADS = 128,
+	ARRAY_LEN = 4096,
+	STRING_LEN = 4096,
+	WIDE_MEMBERS = 256,
+	DEEP_LEVELS = 64,
+	STRING_MEMBERS = 16,
+	MEMBER_LEN = 48,
+	SAMPLES = 16,
+};
+
+struct workload;
+
+typedef size_t (*gen_fn)(const struct workload *w, char *buf, size_t len);
+
+struct workload {
+	char name[32];
+	struct to_json tjs[2];
+	const struct to_json *doc;  // Used instead of 'tjs' if set
+	size_t count;
+	gen_fn baseline;            // Generates the same text with snprintf()
+};
+
+static struct workload workloads[MAXWORKLOADS];
+static int nworkloads;
+
+static char out[MAXLEN];
+static char baseline_out[MAXLEN];
+static char scratch[MAXLEN];
+
+static int json_output;
+static int perf_counters;
+static int latency_mode;
+static int runs = 5;
+static unsigned run_ms = 20;
+static unsigned long latency_calls = 100000;
+static unsigned warmup_ms = 200;
+static int cpu = -1;
+static int max_threads;
+static int share_lines;
+static const char *filter;
+
+static uint32_t seed = 2463534242u;
+
+/* xorshift32, the same sequence on every run */
+static uint32_t
+rnd(void)
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	return seed;
+}
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static struct workload *
+add_workload(const char *prefix, const char *name)
+{
+	if (nworkloads == MAXWORKLOADS){
+		fputs("Too many workloads\n", stderr);
+		exit(1);
+	}
+	struct workload *w = &workloads[nworkloads++];
+	snprintf(w->name, sizeof(w->name), "%s%s", prefix, name);
+	return w;
+}
+
+static const struct to_json *
+document(const struct workload *w)
+{
+	return w->doc ? w->doc : w->tjs;
+}
+
+/* The escaping of gen_string() */
+static size_t
+escape(char *dst, const char *src)
+{
+	char *p = dst;
+	for ( ; *src; src++){
+		if (*src == '"' || *src == '\\')
+			*p++ = '\\';
+		*p++ = *src;
+	}
+	*p = '\0';
+	return (size_t)(p - dst);
+}
+
+static size_t
+snprintf_int_array(const struct workload *w, char *buf, size_t len)
+{
+	const int *v = w->tjs[0].value;
+	size_t l = (size_t)snprintf(buf, len, "[");
+	for (size_t i = 0; i < w->count && l < len; i++)
+		l += (size_t)snprintf(buf + l, len - l, i ? ",%d" : "%d", v[i]);
+	return l + (size_t)snprintf(buf + l, len - l, "]");
+}
+
+static size_t
+snprintf_uint64_array(const struct workload *w, char *buf, size_t len)
+{
+	const uint64_t *v = w->tjs[0].value;
+	size_t l = (size_t)snprintf(buf, len, "[");
+	for (size_t i = 0; i < w->count && l < len; i++)
+		l += (size_t)snprintf(buf + l, len - l, i ? ",%" PRIu64 : "%" PRIu64, v[i]);
+	return l + (size_t)snprintf(buf + l, len - l, "]");
+}
+
+static size_t
+snprintf_string(const struct workload *w, char *buf, size_t len)
+{
+	escape(scratch, w->tjs[0].value);
+	return (size_t)snprintf(buf, len, "\"%s\"", scratch);
+}
+
+/* Objects of int or string members */
+static size_t
+snprintf_object(const struct workload *w, char *buf, size_t len)
+{
+	size_t l = (size_t)snprintf(buf, len, "{");
+	for (const struct to_json *m = w->doc; m->name && l < len; m++){
+		const char *sep = m == w->doc ? "" : ",";
+		if (m->vtype == t_to_int){
+			l += (size_t)snprintf(buf + l, len - l, "%s\"%s\":%d", sep, m->name,
+					*(const int*)m->value);
+		} else {
+			escape(scratch, m->value);
+			l += (size_t)snprintf(buf + l, len - l, "%s\"%s\":\"%s\"", sep,
+					m->name, scratch);
+		}
+	}
+	return l + (size_t)snprintf(buf + l, len - l, "}");
+}
+
+struct int_type {
+	const char *name;
+	enum json_to_type vtype;
+	const void *extreme;  // Value with the longest text
+};
+
+static const int ext_int = INT_MIN;
+static const int8_t ext_int8 = INT8_MIN;
+static const int16_t ext_int16 = INT16_MIN;
+static const int32_t ext_int32 = INT32_MIN;
+static const int64_t ext_int64 = INT64_MIN;
+static const long ext_long = LONG_MIN;
+static const long long ext_longlong = LLONG_MIN;
+static const unsigned ext_uint = UINT_MAX;
+static const uint8_t ext_uint8 = UINT8_MAX;
+static const uint16_t ext_uint16 = UINT16_MAX;
+static const uint32_t ext_uint32 = UINT32_MAX;
+static const uint64_t ext_uint64 = UINT64_MAX;
+static const unsigned long ext_ulong = ULONG_MAX;
+static const unsigned long long ext_ulonglong = ULLONG_MAX;
+
+static const struct int_type int_types[] = {
+	{ "int", t_to_int, &ext_int },
+	{ "int8_t", t_to_int8_t, &ext_int8 },
+	{ "int16_t", t_to_int16_t, &ext_int16 },
+	{ "int32_t", t_to_int32_t, &ext_int32 },
+	{ "int64_t", t_to_int64_t, &ext_int64 },
+	{ "long", t_to_long, &ext_long },
+	{ "longlong", t_to_longlong, &ext_longlong },
+	{ "uint", t_to_uint, &ext_uint },
+	{ "uint8_t", t_to_uint8_t, &ext_uint8 },
+	{ "uint16_t", t_to_uint16_t, &ext_uint16 },
+	{ "uint32_t", t_to_uint32_t, &ext_uint32 },
+	{ "uint64_t", t_to_uint64_t, &ext_uint64 },
+	{ "ulong", t_to_ulong, &ext_ulong },
+	{ "ulonglong", t_to_ulonglong, &ext_ulonglong },
+	{ "hex", t_to_hex, &ext_uint },
+	{ "hex_u8", t_to_hex_u8, &ext_uint8 },
+	{ "hex_u16", t_to_hex_u16, &ext_uint16 },
+	{ "hex_u32", t_to_hex_u32, &ext_uint32 },
+	{ "hex_u64", t_to_hex_u64, &ext_uint64 },
+};
+
+enum { NINT_TYPES = sizeof(int_types) / sizeof(int_types[0]) };
+
+/* Random bytes, so all integer types are spread over their full range */
+static uint64_t array_data[NINT_TYPES][ARRAY_LEN];
+static _Bool bool_data[ARRAY_LEN];
+
+static const _Bool ext_bool = 1;
+
+static void
+setup_scalars(void)
+{
+	for (int i = 0; i < NINT_TYPES; i++){
+		struct workload *w = add_workload("scalar_", int_types[i].name);
+		w->tjs[0] = (struct to_json){ .value = int_types[i].extreme,
+			.vtype = int_types[i].vtype, };
+	}
+
+	struct workload *w = add_workload("scalar_", "boolean");
+	w->tjs[0] = (struct to_json){ .value = &ext_bool, .vtype = t_to_boolean, };
+	w = add_workload("scalar_", "null");
+	w->tjs[0] = (struct to_json){ .vtype = t_to_null, };
+	w = add_workload("scalar_", "string");
+	w->tjs[0] = (struct to_json){ .value = "running", .vtype = t_to_string, };
+	w = add_workload("scalar_", "value");
+	w->tjs[0] = (struct to_json){ .value = "3.14159", .vtype = t_to_value, };
+}
+
+static void
+setup_arrays(void)
+{
+	for (int i = 0; i < NINT_TYPES; i++){
+		uint64_t *data = array_data[i];
+		for (size_t k = 0; k < ARRAY_LEN; k++)
+			data[k] = (uint64_t)rnd() << 32 | rnd();
+
+		struct workload *w = add_workload("array_", int_types[i].name);
+		w->count = ARRAY_LEN;
+		w->tjs[0] = (struct to_json){ .value = data, .count = &w->count,
+			.vtype = int_types[i].vtype, };
+		if (int_types[i].vtype == t_to_int)
+			w->baseline = snprintf_int_array;
+		else if (int_types[i].vtype == t_to_uint64_t)
+			w->baseline = snprintf_uint64_array;
+	}
+
+	for (size_t k = 0; k < ARRAY_LEN; k++)
+		bool_data[k] = rnd() & 1;
+	struct workload *w = add_workload("array_", "boolean");
+	w->count = ARRAY_LEN;
+	w->tjs[0] = (struct to_json){ .value = bool_data, .count = &w->count,
+		.vtype = t_to_boolean, };
+}
+
+static const unsigned escape_density[] = { 0, 1, 10, 50, 100 };
+
+enum { NDENSITIES = sizeof(escape_density) / sizeof(escape_density[0]) };
+
+static char strings[NDENSITIES][STRING_LEN + 1];
+
+/*
+ * Strings of which the given percentage of characters must be escaped, the
+ * generator escapes only '"' and '\'
+ */
+static void
+setup_strings(void)
+{
+	static const char escaped[] = "\"\\";
+	for (int i = 0; i < NDENSITIES; i++){
+		for (size_t k = 0; k < STRING_LEN; k++){
+			if (rnd() % 100 < escape_density[i])
+				strings[i][k] = escaped[rnd() % (sizeof(escaped) - 1)];
+			else
+				strings[i][k] = (char)('a' + rnd() % 26);
+		}
+
+		char name[16];
+		snprintf(name, sizeof(name), "%u", escape_density[i]);
+		struct workload *w = add_workload("string_escape_", name);
+		w->tjs[0] = (struct to_json){ .value = strings[i], .vtype = t_to_string, };
+		w->baseline = snprintf_string;
+	}
+}
+
+static struct to_json wide[WIDE_MEMBERS + 1];
+static char wide_names[WIDE_MEMBERS][8];
+static int wide_values[WIDE_MEMBERS];
+
+static struct to_json deep[DEEP_LEVELS][3];
+static int deep_values[DEEP_LEVELS];
+
+static void
+setup_structures(void)
+{
+	for (int i = 0; i < WIDE_MEMBERS; i++){
+		snprintf(wide_names[i], sizeof(wide_names[i]), "m%d", i);
+		wide_values[i] = (int)(rnd() % 100000);
+		wide[i] = (struct to_json){ .name = wide_names[i],
+			.value = &wide_values[i], .vtype = t_to_int, };
+	}
+	wide[0].stype = t_to_object;
+	struct workload *w = add_workload("object_", "wide");
+	w->doc = wide;
+	w->baseline = snprintf_object;
+
+	for (int i = 0; i < DEEP_LEVELS; i++){
+		deep_values[i] = i;
+		deep[i][0] = (struct to_json){ .name = "v", .value = &deep_values[i],
+			.vtype = t_to_int, .stype = t_to_object, };
+		deep[i][1] = (struct to_json){ .name = "next",
+			.value = i + 1 < DEEP_LEVELS ? deep[i + 1] : NULL,
+			.vtype = t_to_object, };
+	}
+	add_workload("object_", "deep")->doc = deep[0];
+}
+
+static struct to_json member_strings[STRING_MEMBERS + 1];
+static char member_names[STRING_MEMBERS][8];
+static char member_values[STRING_MEMBERS][MEMBER_LEN + 1];
+
+/* A status report as it is typically sent by a device */
+static const struct {
+	unsigned id;
+	const char *name;
+	_Bool enabled;
+	int temp;
+	int samples[SAMPLES];
+	int x;
+	int y;
+} status = {
+	4711, "sensor-7", 1, -12,
+	{ 512, 498, 1023, 7, 0, -3, 77, 1500, 880, 42, 9, 310, 64, 2048, -1, 256 },
+	-120422, 52314,
+};
+
+static const size_t samples_count = SAMPLES;
+
+static const struct to_json status_pos[] = {
+	{ .name = "x", .value = &status.x, .vtype = t_to_int, .stype = t_to_object, },
+	{ .name = "y", .value = &status.y, .vtype = t_to_int, },
+	{ NULL }
+};
+
+static const struct to_json status_json[] = {
+	{ .name = "id", .value = &status.id, .vtype = t_to_uint, .stype = t_to_object, },
+	{ .name = "name", .value = status.name, .vtype = t_to_string, },
+	{ .name = "enabled", .value = &status.enabled, .vtype = t_to_boolean, },
+	{ .name = "temp", .value = &status.temp, .vtype = t_to_int, },
+	{ .name = "samples", .value = status.samples, .count = &samples_count,
+		.vtype = t_to_int, },
+	{ .name = "pos", .value = status_pos, .vtype = t_to_object, },
+	{ NULL }
+};
+
+static size_t
+snprintf_status(const struct workload *w, char *buf, size_t len)
+{
+	(void)w;
+	size_t l = (size_t)snprintf(buf, len,
+			"{\"id\":%u,\"name\":\"%s\",\"enabled\":%s,\"temp\":%d,\"samples\":[",
+			status.id, status.name, status.enabled ? "true" : "false", status.temp);
+	for (size_t i = 0; i < SAMPLES && l < len; i++)
+		l += (size_t)snprintf(buf + l, len - l, i ? ",%d" : "%d", status.samples[i]);
+	return l + (size_t)snprintf(buf + l, len - l, "],\"pos\":{\"x\":%d,\"y\":%d}}",
+			status.x, status.y);
+}
+
+static void
+setup_mixed(void)
+{
+	struct workload *w = add_workload("mixed_", "status");
+	w->doc = status_json;
+	w->baseline = snprintf_status;
+
+	/* Mostly strings, few of them need escaping */
+	for (int i = 0; i < STRING_MEMBERS; i++){
+		snprintf(member_names[i], sizeof(member_names[i]), "s%d", i);
+		for (size_t k = 0; k < MEMBER_LEN; k++)
+			member_values[i][k] = rnd() % 50 ? (char)('a' + rnd() % 26) : '"';
+		member_strings[i] = (struct to_json){ .name = member_names[i],
+			.value = member_values[i], .vtype = t_to_string, };
+	}
+	member_strings[0].stype = t_to_object;
+	w = add_workload("mixed_", "strings");
+	w->doc = member_strings;
+	w->baseline = snprintf_object;
+}
+
+static size_t
+generate(const struct workload *w, char *buf, size_t len)
+{
+	return json_generate(buf, document(w), len);
+}
+
+/* Returns the time of 'n' calls in ns */
+static uint64_t
+time_calls(gen_fn fn, const struct workload *w, char *buf, unsigned long n)
+{
+	uint64_t start = now_ns();
+	for (unsigned long i = 0; i < n; i++)
+		if (!fn(w, buf, MAXLEN))
+			return 0;
+	return now_ns() - start;
+}
+
+/* Returns the ns per call of the fastest run, sets 'calls' to calls per run */
+static double
+fastest(gen_fn fn, const struct workload *w, char *buf, unsigned long *calls)
+{
+	/* Calibrate the number of calls per run */
+	unsigned long n = 1;
+	while (time_calls(fn, w, buf, n) < (uint64_t)run_ms * 1000000 && n < ULONG_MAX / 2)
+		n *= 2;
+
+	double best = 0;
+	for (int r = 0; r < runs; r++){
+		double ns = (double)time_calls(fn, w, buf, n) / (double)n;
+		if (!r || ns < best)
+			best = ns;
+	}
+	*calls = n;
+	return best;
+}
+
+enum counter {
+	CYCLES,
+	INSTRUCTIONS,
+	BRANCH_MISSES,
+	L1D_MISSES,
+	NCOUNTERS,
+};
+
+static int counter_fd[NCOUNTERS] = { -1, -1, -1, -1 };
+
+#ifdef __linux__
+static const struct perf_event_attr counter_attr[NCOUNTERS] = {
+	[CYCLES] = { .type = PERF_TYPE_HARDWARE, .config = PERF_COUNT_HW_CPU_CYCLES, },
+	[INSTRUCTIONS] = { .type = PERF_TYPE_HARDWARE, .config = PERF_COUNT_HW_INSTRUCTIONS, },
+	[BRANCH_MISSES] = { .type = PERF_TYPE_HARDWARE, .config = PERF_COUNT_HW_BRANCH_MISSES, },
+	[L1D_MISSES] = { .type = PERF_TYPE_HW_CACHE, .config = PERF_COUNT_HW_CACHE_L1D
+		| PERF_COUNT_HW_CACHE_OP_READ << 8 | PERF_COUNT_HW_CACHE_RESULT_MISS << 16, },
+};
+
+static void
+open_counters(void)
+{
+	int err = 0;
+	int opened = 0;
+	for (int i = 0; i < NCOUNTERS; i++){
+		struct perf_event_attr attr = counter_attr[i];
+		attr.size = sizeof(attr);
+		attr.disabled = 1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+		counter_fd[i] = (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+		if (counter_fd[i] < 0)
+			err = errno;
+		else
+			opened++;
+	}
+	if (!opened)
+		fprintf(stderr, "Performance counters not available: %s\n", strerror(err));
+}
+
+/* Counts the events of 'n' calls, -1 for counters not available */
+static void
+count_calls(gen_fn fn, const struct workload *w, char *buf, unsigned long n,
+		double count[NCOUNTERS])
+{
+	for (int i = 0; i < NCOUNTERS; i++)
+		if (counter_fd[i] >= 0){
+			ioctl(counter_fd[i], PERF_EVENT_IOC_RESET, 0);
+			ioctl(counter_fd[i], PERF_EVENT_IOC_ENABLE, 0);
+		}
+	time_calls(fn, w, buf, n);
+	for (int i = 0; i < NCOUNTERS; i++)
+		if (counter_fd[i] >= 0)
+			ioctl(counter_fd[i], PERF_EVENT_IOC_DISABLE, 0);
+
+	for (int i = 0; i < NCOUNTERS; i++){
+		uint64_t v[3]; // Value, time enabled, time running
+		count[i] = -1;
+		if (counter_fd[i] < 0 || read(counter_fd[i], v, sizeof(v)) != sizeof(v) || !v[2])
+			continue;
+		/* Scale if the counter was multiplexed with others */
+		count[i] = (double)v[0] * ((double)v[1] / (double)v[2]);
+	}
+}
+#else
+static void
+open_counters(void)
+{
+	fputs("Performance counters not available on this system\n", stderr);
+}
+
+static void
+count_calls(gen_fn fn, const struct workload *w, char *buf, unsigned long n,
+		double count[NCOUNTERS])
+{
+	(void)fn, (void)w, (void)buf, (void)n;
+	for (int i = 0; i < NCOUNTERS; i++)
+		count[i] = -1;
+}
+#endif
+
+/* Prints a field of the record, an empty one if not 'valid' */
+static void
+field(const char *name, double value, int decimals, int valid)
+{
+	if (json_output){
+		if (valid)
+			printf(",\"%s\":%.*f", name, decimals, value);
+	} else if (valid){
+		printf(",%.*f", decimals, value);
+	} else {
+		putchar(',');
+	}
+}
+
+static int
+run(const struct workload *w, int first)
+{
+	size_t len = generate(w, out, MAXLEN);
+	if (!len){
+		fprintf(stderr, "%s: json_generate() failed\n", w->name);
+		return 1;
+	}
+	if (w->baseline && (w->baseline(w, baseline_out, MAXLEN) != len
+				|| memcmp(out, baseline_out, len))){
+		fprintf(stderr, "%s: snprintf() baseline differs\n", w->name);
+		fprintf(stderr, "Expected : %.200s\n", baseline_out);
+		fprintf(stderr, "Generated: %.200s\n", out);
+		return 1;
+	}
+
+	unsigned long n;
+	double best = fastest(generate, w, out, &n);
+	double base = 0;
+	if (w->baseline){
+		unsigned long base_n;
+		base = fastest(w->baseline, w, baseline_out, &base_n);
+	}
+
+	if (json_output)
+		printf("%s{\"workload\":\"%s\",\"bytes\":%zu", first ? "" : ",\n",
+				w->name, len);
+	else
+		printf("%s,%zu", w->name, len);
+	field("ns_per_op", best, 2, 1);
+	field("mb_per_s", (double)len / best * 1e3, 2, 1);
+	field("docs_per_s", 1e9 / best, 0, 1);
+	field("snprintf_ns_per_op", base, 2, base > 0);
+	field("speedup", base / best, 2, base > 0);
+
+	if (perf_counters){
+		double c[NCOUNTERS];
+		count_calls(generate, w, out, n, c);
+		double bytes = (double)len * (double)n;
+		field("cycles_per_byte", c[CYCLES] / bytes, 3, c[CYCLES] >= 0);
+		field("instructions_per_byte", c[INSTRUCTIONS] / bytes, 3, c[INSTRUCTIONS] >= 0);
+		field("ipc", c[INSTRUCTIONS] / c[CYCLES], 2, c[INSTRUCTIONS] >= 0 && c[CYCLES] > 0);
+		field("branch_misses_per_byte", c[BRANCH_MISSES] / bytes, 5,
+				c[BRANCH_MISSES] >= 0);
+		field("l1d_misses_per_byte", c[L1D_MISSES] / bytes, 5, c[L1D_MISSES] >= 0);
+	}
+
+	putchar(json_output ? '}' : '\n');
+	fflush(stdout);
+	return 0;
+}
+
+/*
+ * Latency histogram: values below 2^SUB_BITS ns have a bucket each, above
+ * every power of two is divided into 2^(SUB_BITS - 1) buckets, so a bucket is
+ * at most 1 / 2^(SUB_BITS - 1) of its value wide.
+ */
+enum {
+	SUB_BITS = 6,
+	HALF = 1 << (SUB_BITS - 1),
+	NBUCKETS = (64 - SUB_BITS + 2) * HALF,
+};
+
+static uint64_t histogram[NBUCKETS];
+
+static unsigned
+bucket(uint64_t ns)
+{
+	unsigned msb = 63 - (unsigned)__builtin_clzll(ns | 1);
+	unsigned shift = msb < SUB_BITS ? 0 : msb - SUB_BITS + 1;
+	return shift * HALF + (unsigned)(ns >> shift);
+}
+
+/* Returns the highest value of bucket 'b' */
+static uint64_t
+bucket_max(unsigned b)
+{
+	unsigned shift = b < 2 * HALF ? 0 : b / HALF - 1;
+	return (((uint64_t)(b - shift * HALF) + 1) << shift) - 1;
+}
+
+/* Returns the highest value of the bucket holding 'p' percent of the calls */
+static uint64_t
+percentile(double p, uint64_t calls)
+{
+	uint64_t rank = (uint64_t)(p / 100 * (double)calls + 0.5);
+	if (rank < 1)
+		rank = 1;
+
+	uint64_t seen = 0;
+	for (unsigned b = 0; b < NBUCKETS; b++){
+		seen += histogram[b];
+		if (seen >= rank)
+			return bucket_max(b);
+	}
+	return 0;
+}
+
+static int
+latency(const struct workload *w, int first)
+{
+	const struct to_json *tjs = document(w);
+	size_t len = json_generate(out, tjs, MAXLEN);
+	if (!len){
+		fprintf(stderr, "%s: json_generate() failed\n", w->name);
+		return 1;
+	}
+
+	/* Fill the caches and let the CPU reach its clock */
+	uint64_t end = now_ns() + (uint64_t)warmup_ms * 1000000;
+	while (now_ns() < end)
+		json_generate(out, tjs, MAXLEN);
+
+	memset(histogram, 0, sizeof(histogram));
+	uint64_t min = UINT64_MAX;
+	uint64_t max = 0;
+	uint64_t sum = 0;
+	for (unsigned long i = 0; i < latency_calls; i++){
+		uint64_t start = now_ns();
+		json_generate(out, tjs, MAXLEN);
+		uint64_t ns = now_ns() - start;
+		histogram[bucket(ns)]++;
+		sum += ns;
+		if (ns < min)
+			min = ns;
+		if (ns > max)
+			max = ns;
+	}
+
+	if (json_output)
+		printf("%s{\"workload\":\"%s\",\"bytes\":%zu,\"calls\":%lu",
+				first ? "" : ",\n", w->name, len, latency_calls);
+	else
+		printf("%s,%zu,%lu", w->name, len, latency_calls);
+	field("min_ns", (double)min, 0, 1);
+	static const double p[] = { 50, 90, 99, 99.9 };
+	static const char * const names[] = { "p50_ns", "p90_ns", "p99_ns", "p999_ns" };
+	for (int i = 0; i < 4; i++){
+		/* The bucket may reach beyond the measured values */
+		uint64_t v = percentile(p[i], latency_calls);
+		v = v > max ? max : v < min ? min : v;
+		field(names[i], (double)v, 0, 1);
+	}
+	field("max_ns", (double)max, 0, 1);
+	field("mean_ns", (double)sum / (double)latency_calls, 1, 1);
+	putchar(json_output ? '}' : '\n');
+	fflush(stdout);
+	return 0;
+}
+
+static int
+pin(int n)
+{
+#ifdef __linux__
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET((size_t)n, &set);
+	if (!sched_setaffinity(0, sizeof(set), &set))
+		return 0;
+	perror("sched_setaffinity");
+#else
+	(void)n;
+	fputs("Pinning is not supported on this system\n", stderr);
+#endif
+	return -1;
+}
+
+/* Prints the time of two calls to now_ns(), which is part of every latency */
+static void
+timer_overhead(void)
+{
+	uint64_t min = UINT64_MAX;
+	for (int i = 0; i < 1000; i++){
+		uint64_t t = now_ns();
+		uint64_t d = now_ns() - t;
+		if (d < min)
+			min = d;
+	}
+	fprintf(stderr, "Timer overhead: %" PRIu64 " ns\n", min);
+}
+
+struct worker {
+	pthread_t thread;
+	const struct workload *w;
+	char *buf;
+	size_t size;
+	int cpu;
+	unsigned long calls;
+	unsigned long mismatches;
+};
+
+static pthread_barrier_t start_barrier;
+static int stop;
+
+static void *
+work(void *arg)
+{
+	struct worker *wk = arg;
+	const struct to_json *tjs = document(wk->w);
+	size_t len = wk->size - 1;
+	if (wk->cpu >= 0)
+		pin(wk->cpu);
+
+	/* Counted locally, the workers share cache lines */
+	unsigned long calls = 0;
+	unsigned long mismatches = 0;
+	pthread_barrier_wait(&start_barrier);
+	while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)){
+		if (json_generate(wk->buf, tjs, wk->size) != len || memcmp(wk->buf, out, len))
+			mismatches++;
+		calls++;
+	}
+	wk->calls = calls;
+	wk->mismatches = mismatches;
+	return NULL;
+}
+
+/* Returns the documents/s of 'n' threads, counts wrong documents in 'mismatches' */
+static double
+run_threads(const struct workload *w, size_t len, int n, unsigned long *mismatches)
+{
+	/* Buffers are a multiple of the cache line size apart, with -s directly after
+	 * each other, so the end of one shares a line with the start of the next. */
+	size_t stride = share_lines ? len + 1 : (len + 1 + 127) / 128 * 128;
+	char *bufs;
+	struct worker *workers = calloc((size_t)n, sizeof(*workers));
+	if (!workers || posix_memalign((void**)&bufs, 128, stride * (size_t)n)){
+		perror("Can't allocate buffers");
+		exit(1);
+	}
+
+	pthread_barrier_init(&start_barrier, NULL, (unsigned)n + 1);
+	__atomic_store_n(&stop, 0, __ATOMIC_RELAXED);
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	for (int i = 0; i < n; i++){
+		workers[i] = (struct worker){ .w = w, .buf = bufs + stride * (size_t)i,
+			.size = len + 1, .cpu = cpu < 0 ? -1 : (int)((cpu + i) % ncpu), };
+		if (pthread_create(&workers[i].thread, NULL, work, &workers[i])){
+			perror("pthread_create");
+			exit(1);
+		}
+	}
+
+	pthread_barrier_wait(&start_barrier);
+	uint64_t start = now_ns();
+	usleep(run_ms * (unsigned)runs * 1000);
+	__atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+
+	unsigned long calls = 0;
+	*mismatches = 0;
+	for (int i = 0; i < n; i++){
+		pthread_join(workers[i].thread, NULL);
+		calls += workers[i].calls;
+		*mismatches += workers[i].mismatches;
+	}
+	uint64_t ns = now_ns() - start;
+
+	pthread_barrier_destroy(&start_barrier);
+	free(bufs);
+	free(workers);
+	return (double)calls / (double)ns * 1e9;
+}
+
+static int
+scaling(const struct workload *w, int first)
+{
+	size_t len = json_generate(out, document(w), MAXLEN);
+	if (!len){
+		fprintf(stderr, "%s: json_generate() failed\n", w->name);
+		return 1;
+	}
+
+	int err = 0;
+	double single = 0;
+	for (int n = 1; n <= max_threads; n = n < max_threads && 2 * n > max_threads ? max_threads : 2 * n){
+		unsigned long mismatches;
+		double docs = run_threads(w, len, n, &mismatches);
+		if (n == 1)
+			single = docs;
+		if (mismatches){
+			fprintf(stderr, "%s: %lu wrong documents with %d threads, "
+					"is there state shared between threads?\n",
+					w->name, mismatches, n);
+			err = 1;
+		}
+
+		if (json_output)
+			printf("%s{\"workload\":\"%s\",\"bytes\":%zu,\"threads\":%d",
+					first ? "" : ",\n", w->name, len, n);
+		else
+			printf("%s,%zu,%d", w->name, len, n);
+		field("docs_per_s", docs, 0, 1);
+		field("mb_per_s", docs * (double)len / 1e6, 2, 1);
+		field("speedup", docs / single, 2, 1);
+		field("efficiency", docs / single / n, 2, 1);
+		field("mismatches", (double)mismatches, 0, 1);
+		putchar(json_output ? '}' : '\n');
+		fflush(stdout);
+		first = 0;
+	}
+	return err;
+}
+
+int
+main(int argc, char *argv[])
+{
+	int opt;
+	while ((opt = getopt(argc, argv, "c:f:hjlm:n:pr:st:w:")) != -1){
+		switch (opt){
+		case 'c':
+			cpu = atoi(optarg);
+			break;
+		case 'f':
+			filter = optarg;
+			break;
+		case 'j':
+			json_output = 1;
+			break;
+		case 'l':
+			latency_mode = 1;
+			break;
+		case 'm':
+			max_threads = atoi(optarg);
+			break;
+		case 'n':
+			latency_calls = strtoul(optarg, NULL, 10);
+			break;
+		case 'p':
+			perf_counters = 1;
+			break;
+		case 'r':
+			runs = atoi(optarg);
+			break;
+		case 's':
+			share_lines = 1;
+			break;
+		case 't':
+			run_ms = (unsigned)atoi(optarg);
+			break;
+		case 'w':
+			warmup_ms = (unsigned)atoi(optarg);
+			break;
+		case 'h':
+		default:
+			fputs("usage: bench_mtojson [-jp] [-f filter] [-r runs] [-t ms]\n"
+					"       bench_mtojson -l [-j] [-f filter] [-n calls] [-w ms] [-c cpu]\n"
+					"       bench_mtojson -m threads [-js] [-f filter] [-r runs] [-t ms] [-c cpu]\n", stderr);
+			return 1;
+		}
+	}
+	if (runs < 1)
+		runs = 1;
+	if (latency_calls < 1)
+		latency_calls = 1;
+	if (max_threads < 0)
+		max_threads = 0;
+	/* Threads are pinned one by one */
+	if (!max_threads && cpu >= 0 && pin(cpu))
+		return 1;
+
+	setup_scalars();
+	setup_arrays();
+	setup_strings();
+	setup_structures();
+	setup_mixed();
+
+	if (perf_counters && !latency_mode && !max_threads)
+		open_counters();
+	if (latency_mode)
+		timer_overhead();
+
+	if (json_output)
+		fputs("[\n", stdout);
+	else if (max_threads)
+		puts("workload,bytes,threads,docs_per_s,mb_per_s,speedup,efficiency,mismatches");
+	else if (latency_mode)
+		puts("workload,bytes,calls,min_ns,p50_ns,p90_ns,p99_ns,p999_ns,max_ns,mean_ns");
+	else
+		printf("workload,bytes,ns_per_op,mb_per_s,docs_per_s,snprintf_ns_per_op,speedup%s\n",
+				perf_counters ? ",cycles_per_byte,instructions_per_byte,ipc,"
+				"branch_misses_per_byte,l1d_misses_per_byte" : "");
+
+	int err = 0;
+	int first = 1;
+	for (int i = 0; i < nworkloads; i++){
+		if (filter && !strstr(workloads[i].name, filter))
+			continue;
+		if (max_threads)
+			err |= scaling(&workloads[i], first);
+		else
+			err |= (latency_mode ? latency : run)(&workloads[i], first);
+		first = 0;
+	}
+
+	if (json_output)
+		fputs("\n]\n", stdout);
+	return err;
+}
@@ -0,0 +1,320 @@
+/*
+ * Benchmark of the C++ reflection against hand-written descriptors
+ *
+ * Every workload is an aggregate which is serialized by json::serialize()
+ * using the reflection of its fields, and described by a hand-written
+ * descriptor for json_generate(), as C code would do it. Both must produce
+ * the same text, otherwise the benchmark fails.
+ *
+ * Output is CSV, or JSON with -j, one record per workload: workload, length
+ * of the JSON text, ns per call of both and the speedup of the reflection.
+ * The number of calls per run is calibrated like in bench_mtojson, the
+ * fastest of all runs is reported. All input data is generated from a fixed
+ * seed.
+ */
+
+/*
+ * SPDX-License-Identifier: BSD-2-Clause
+ * This file is Copyright (c) 2020, 2021 by Rene Kita
+ */
+
+#include "mtojson.hpp"
+
+#include <chrono>
+#include <climits>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string_view>
+#include <unistd.h>
+
+struct point {
+	int x;
+	int y;
+};
+MTOJSON_NAMES(point, "x", "y");
+
+struct reading {
+	point pos;
+	unsigned short values[2];
+	bool ok;
+	char label[8];
+};
+MTOJSON_NAMES(reading, "pos", "values", "ok", "label");
+
+struct sensor {
+	long id;
+	std::int64_t uptime;
+	std::uint16_t flags;
+	unsigned errors;
+	int temp;
+	bool enabled;
+	char name[24];
+	point pos;
+	int samples[16];
+};
+MTOJSON_NAMES(sensor, "id", "uptime", "flags", "errors", "temp", "enabled",
+		"name", "pos", "samples");
+
+enum { NPOINTS = 32 };
+
+struct track {
+	unsigned id;
+	point points[NPOINTS];
+};
+MTOJSON_NAMES(track, "id", "points");
+
+namespace {
+
+enum { MAXLEN = 4096 };
+
+bool json_output = false;
+int runs = 5;
+unsigned run_ms = 20;
+const char *filter = nullptr;
+
+std::uint32_t seed = 2463534242u;
+
+/* xorshift32, the same sequence on every run */
+std::uint32_t
+rnd()
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	return seed;
+}
+
+int
+rnd_int()
+{
+	return static_cast<int>(rnd());
+}
+
+std::uint64_t
+now_ns()
+{
+	using namespace std::chrono;
+	return static_cast<std::uint64_t>(duration_cast<nanoseconds>(
+				steady_clock::now().time_since_epoch()).count());
+}
+
+/* Keeps the compiler from dropping or merging the writes to 'p' */
+void
+clobber(const void *p)
+{
+#if defined(__GNUC__)
+	__asm__ volatile("" : : "r"(p) : "memory");
+#else
+	(void)p;
+#endif
+}
+
+/* Returns the time of 'n' calls of 'fn' writing to 'out' in ns */
+template<typename F>
+std::uint64_t
+time_calls(F fn, const char *out, unsigned long n)
+{
+	std::uint64_t start = now_ns();
+	for (unsigned long i = 0; i < n; i++){
+		if (!fn())
+			return 0;
+		clobber(out);
+	}
+	return now_ns() - start;
+}
+
+/* Returns the ns per call of the fastest run */
+template<typename F>
+double
+fastest(F fn, const char *out)
+{
+	/* Calibrate the number of calls per run */
+	unsigned long n = 1;
+	while (time_calls(fn, out, n) < static_cast<std::uint64_t>(run_ms) * 1000000
+			&& n < ULONG_MAX / 2)
+		n *= 2;
+
+	double best = 0;
+	for (int r = 0; r < runs; r++){
+		double ns = static_cast<double>(time_calls(fn, out, n)) / static_cast<double>(n);
+		if (!r || ns < best)
+			best = ns;
+	}
+	return best;
+}
+
+bool first_record = true;
+
+/* Times both serializations of 'doc', returns 1 if their texts differ */
+template<typename T>
+int
+run(const char *name, const T &doc, const struct to_json *tjs)
+{
+	if (filter && !std::strstr(name, filter))
+		return 0;
+
+	static char desc_out[MAXLEN];
+	static json::buffer<T> refl_out;
+	std::size_t len = json_generate(desc_out, tjs, MAXLEN);
+	std::size_t refl_len = json::serialize(refl_out, doc);
+	if (!len || len != refl_len || std::strcmp(desc_out, refl_out.data())){
+		std::fprintf(stderr, "%s: texts differ\nDescriptor: %s\nReflection: %s\n",
+				name, desc_out, refl_out.data());
+		return 1;
+	}
+
+	double desc_ns = fastest([tjs]{ return json_generate(desc_out, tjs, MAXLEN); },
+			desc_out);
+	double refl_ns = fastest([&doc]{ return json::serialize(refl_out, doc); },
+			refl_out.data());
+
+	if (json_output){
+		std::printf("%s  { \"workload\": \"%s\", \"bytes\": %zu, \"descriptor_ns_per_op\": %.2f, "
+				"\"reflection_ns_per_op\": %.2f, \"speedup\": %.2f }",
+				first_record ? "" : ",\n", name, len, desc_ns, refl_ns, desc_ns / refl_ns);
+	} else {
+		std::printf("%s,%zu,%.2f,%.2f,%.2f\n", name, len, desc_ns, refl_ns,
+				desc_ns / refl_ns);
+	}
+	first_record = false;
+	return 0;
+}
+
+/* Descriptors as written by hand for the aggregates, members which are not
+ * named are 0 like in C */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmissing-field-initializers"
+
+point pt;
+const struct to_json point_json[] = {
+	{ .name = "x", .value = &pt.x, .stype = t_to_object, .vtype = t_to_int, },
+	{ .name = "y", .value = &pt.y, .vtype = t_to_int, },
+	{ nullptr }
+};
+
+reading rd;
+const std::size_t values_count = 2;
+const struct to_json reading_pos[] = {
+	{ .name = "x", .value = &rd.pos.x, .stype = t_to_object, .vtype = t_to_int, },
+	{ .name = "y", .value = &rd.pos.y, .vtype = t_to_int, },
+	{ nullptr }
+};
+const struct to_json reading_json[] = {
+	{ .name = "pos", .value = reading_pos, .stype = t_to_object, .vtype = t_to_object, },
+	{ .name = "values", .value = rd.values, .count = &values_count, .vtype = t_to_uint16_t, },
+	{ .name = "ok", .value = &rd.ok, .vtype = t_to_boolean, },
+	{ .name = "label", .value = rd.label, .vtype = t_to_string, },
+	{ nullptr }
+};
+
+sensor sn;
+const std::size_t samples_count = 16;
+const struct to_json sensor_pos[] = {
+	{ .name = "x", .value = &sn.pos.x, .stype = t_to_object, .vtype = t_to_int, },
+	{ .name = "y", .value = &sn.pos.y, .vtype = t_to_int, },
+	{ nullptr }
+};
+const struct to_json sensor_json[] = {
+	{ .name = "id", .value = &sn.id, .stype = t_to_object, .vtype = t_to_long, },
+	{ .name = "uptime", .value = &sn.uptime, .vtype = t_to_int64_t, },
+	{ .name = "flags", .value = &sn.flags, .vtype = t_to_uint16_t, },
+	{ .name = "errors", .value = &sn.errors, .vtype = t_to_uint, },
+	{ .name = "temp", .value = &sn.temp, .vtype = t_to_int, },
+	{ .name = "enabled", .value = &sn.enabled, .vtype = t_to_boolean, },
+	{ .name = "name", .value = sn.name, .vtype = t_to_string, },
+	{ .name = "pos", .value = sensor_pos, .vtype = t_to_object, },
+	{ .name = "samples", .value = sn.samples, .count = &samples_count, .vtype = t_to_int, },
+	{ nullptr }
+};
+
+track tr;
+struct to_json track_point[NPOINTS][3];
+struct to_json track_points[NPOINTS + 1];
+const struct to_json track_json[] = {
+	{ .name = "id", .value = &tr.id, .stype = t_to_object, .vtype = t_to_uint, },
+	{ .name = "points", .value = track_points, .vtype = t_to_array, },
+	{ nullptr }
+};
+
+void
+setup()
+{
+	pt = { rnd_int(), rnd_int() };
+
+	rd = { { rnd_int(), rnd_int() }, { static_cast<unsigned short>(rnd()),
+		static_cast<unsigned short>(rnd()) }, true, "r\"1" };
+
+	sn.id = static_cast<long>(rnd()) * 1000;
+	sn.uptime = static_cast<std::int64_t>(rnd()) << 20;
+	sn.flags = static_cast<std::uint16_t>(rnd());
+	sn.errors = rnd() % 100;
+	sn.temp = rnd_int() % 50;
+	sn.enabled = true;
+	std::strcpy(sn.name, "living room sensor");
+	sn.pos = { rnd_int() % 1000, rnd_int() % 1000 };
+	for (int &s : sn.samples)
+		s = rnd_int() % 100000;
+
+	tr.id = rnd();
+	for (int i = 0; i < NPOINTS; i++){
+		tr.points[i] = { rnd_int() % 100000, rnd_int() % 100000 };
+		track_point[i][0] = { .name = "x", .value = &tr.points[i].x,
+			.stype = t_to_object, .vtype = t_to_int, };
+		track_point[i][1] = { .name = "y", .value = &tr.points[i].y,
+			.vtype = t_to_int, };
+		track_point[i][2] = { nullptr };
+		track_points[i] = { .value = track_point[i], .vtype = t_to_object, };
+	}
+	track_points[NPOINTS] = { nullptr };
+}
+
+#pragma GCC diagnostic pop
+
+} // namespace
+
+int
+main(int argc, char *argv[])
+{
+	int opt;
+	while ((opt = getopt(argc, argv, "f:hjr:t:")) != -1){
+		switch (opt){
+		case 'f':
+			filter = optarg;
+			break;
+		case 'j':
+			json_output = true;
+			break;
+		case 'r':
+			runs = std::atoi(optarg);
+			break;
+		case 't':
+			run_ms = static_cast<unsigned>(std::atoi(optarg));
+			break;
+		case 'h':
+		default:
+			std::fputs("usage: bench_mtojson_hpp [-j] [-f filter] [-r runs] [-t ms]\n", stderr);
+			return 1;
+		}
+	}
+	if (runs < 1)
+		runs = 1;
+
+	setup();
+
+	if (json_output)
+		std::fputs("[\n", stdout);
+	else
+		std::puts("workload,bytes,descriptor_ns_per_op,reflection_ns_per_op,speedup");
+
+	int err = 0;
+	err |= run("point", pt, point_json);
+	err |= run("reading", rd, reading_json);
+	err |= run("sensor", sn, sensor_json);
+	err |= run("track", tr, track_json);
+
+	if (json_output)
+		std::fputs("\n]\n", stdout);
+	return err;
+}
@@ -5,12 +5,22 @@
 
 #include "mtojson.h"
 
+#include <limits.h>
 #include <stdint.h>
 #include <string.h>
 
+#if defined(__GNUC__) && defined(__x86_64__)
+#define CRC32C_SSE42
+#include <nmmintrin.h>
+#elif defined(__ARM_FEATURE_CRC32) && defined(__aarch64__)
+#define CRC32C_ARM
+#include <arm_acle.h>
+#endif
+
 static char* gen_array(char *, const void *);
 static char* gen_boolean(char *, const void *);
 static char* gen_c_array(char *, const void *);
+static char* gen_const(char *, const void *);
 static char* gen_hex(char *, const void *);
 static char* gen_hex_u8(char *, const void *);
 static char* gen_hex_u16(char *, const void *);
@@ -23,6 +33,7 @@ static char* gen_int32_t(char *, const void *);
 static char* gen_int64_t(char *, const void *);
 static char* gen_long(char *, const void *);
 static char* gen_longlong(char *, const void *);
+static char* gen_map(char *, const void *);
 static char* gen_null(char *, const void *);
 static char* gen_object(char *, const void *);
 static char* gen_primitive(char *, const void *);
@@ -36,10 +47,13 @@ static char* gen_ulong(char *, const void *);
 static char* gen_ulonglong(char *, const void *);
 static char* gen_value(char *, const void *);
 
+static char* gen_document(char *, const struct to_json *);
+
 static char* (* const gen_functions[])(char *, const void *) = {
 	gen_primitive,
 	gen_array,
 	gen_boolean,
+	gen_const,
 	gen_hex,
 	gen_hex_u8,
 	gen_hex_u16,
@@ -52,6 +66,7 @@ static char* (* const gen_functions[])(char *, const void *) = {
 	gen_int64_t,
 	gen_long,
 	gen_longlong,
+	gen_map,
 	gen_null,
 	gen_object,
 	gen_string,
@@ -65,26 +80,424 @@ static char* (* const gen_functions[])(char *, const void *) = {
 	gen_value,
 };
 
-static size_t remaining_length;
+/*
+ * The state of the generator. With MTOJSON_THREADS defined every thread has
+ * its own, so threads can generate JSON text concurrently.
+ */
+#ifndef MTOJSON_THREADS
+#define STATE static
+#elif __STDC_VERSION__ >= 201112L
+#define STATE static _Thread_local
+#else
+#define STATE static __thread
+#endif
+
+STATE size_t remaining_length;
+
+/* Truncating mode: drop elements that do not fit instead of failing */
+STATE _Bool truncate_mode;
+STATE _Bool truncated;
+STATE size_t omitted_elements;
+
+/* C array which is split into chunks and the elements of the current chunk */
+STATE const struct to_json *split_member;
+STATE size_t split_first;
+STATE size_t split_next;
+STATE size_t split_budget;
+
+/* Level and remaining budget of the members which are included partially */
+STATE unsigned priority_level;
+STATE size_t priority_budget;
+
+/* Delta mode: only generate members changed after 'delta_since' */
+STATE _Bool delta_mode;
+STATE unsigned delta_since;
+
+/*
+ * Buffer the output is generated into. If 'flush_func' is set, the buffer is
+ * passed to it when it is full and reused afterwards.
+ */
+STATE char *buf_start;
+STATE size_t buf_len;
+STATE size_t flushed;
+STATE int (*flush_func)(const char *, size_t);
+
+/* Output function of json_generate_stream() */
+STATE int (*sink_func)(const char *, size_t, void *);
+STATE void *sink_arg;
+
+/* Digests updated with the output, and end of the buffer if not streaming */
+STATE struct json_digest *digest;
+STATE char *digest_end;
+
+/*
+ * Reader whose position is tracked: the index and the start offset of the
+ * element being generated on each level of nesting.
+ */
+STATE struct json_reader *reader;
+STATE unsigned depth;
+STATE unsigned resume_next;
+
+/* Part of the output kept by json_generate_part() */
+STATE char *part_buf;
+STATE size_t part_size;
+STATE size_t part_len;
+STATE size_t part_offset;
+
+/*
+ * Buffer used to count the length of JSON text which doesn't fit. While
+ * counting closing brackets are reserved when they are written, so the depth
+ * of nesting doesn't matter.
+ */
+STATE char count_buf[64];
+STATE _Bool counting;
+
+#ifndef MTOJSON_CALLBACK_DEPTH
+#define MTOJSON_CALLBACK_DEPTH 1
+#endif
+
+/*
+ * The state is saved while a callback runs and the modes are reset, so the
+ * callback can generate JSON text itself.
+ */
+struct saved_state {
+	size_t remaining_length;
+	_Bool truncate_mode;
+	_Bool truncated;
+	size_t omitted_elements;
+	const struct to_json *split_member;
+	size_t split_first;
+	size_t split_next;
+	size_t split_budget;
+	unsigned priority_level;
+	size_t priority_budget;
+	_Bool delta_mode;
+	unsigned delta_since;
+	char *buf_start;
+	size_t buf_len;
+	size_t flushed;
+	int (*flush_func)(const char *, size_t);
+	int (*sink_func)(const char *, size_t, void *);
+	void *sink_arg;
+	struct json_digest *digest;
+	char *digest_end;
+	struct json_reader *reader;
+	unsigned depth;
+	unsigned resume_next;
+	char *part_buf;
+	size_t part_size;
+	size_t part_len;
+	size_t part_offset;
+	_Bool counting;
+};
+
+STATE struct saved_state saved[MTOJSON_CALLBACK_DEPTH];
+STATE unsigned callback_depth;
 
+/* Returns 0 if callbacks are nested too deep */
 static int
-reduce_rem_len(size_t len)
+enter_callback(void)
 {
-	if (remaining_length < len)
+	if (callback_depth == MTOJSON_CALLBACK_DEPTH)
 		return 0;
-	remaining_length -= len;
+
+	struct saved_state *s = &saved[callback_depth++];
+	s->remaining_length = remaining_length;
+	s->truncate_mode = truncate_mode;
+	s->truncated = truncated;
+	s->omitted_elements = omitted_elements;
+	s->split_member = split_member;
+	s->split_first = split_first;
+	s->split_next = split_next;
+	s->split_budget = split_budget;
+	s->priority_level = priority_level;
+	s->priority_budget = priority_budget;
+	s->delta_mode = delta_mode;
+	s->delta_since = delta_since;
+	s->buf_start = buf_start;
+	s->buf_len = buf_len;
+	s->flushed = flushed;
+	s->flush_func = flush_func;
+	s->sink_func = sink_func;
+	s->sink_arg = sink_arg;
+	s->digest = digest;
+	s->digest_end = digest_end;
+	s->reader = reader;
+	s->depth = depth;
+	s->resume_next = resume_next;
+	s->part_buf = part_buf;
+	s->part_size = part_size;
+	s->part_len = part_len;
+	s->part_offset = part_offset;
+	s->counting = counting;
+
+	truncate_mode = 0;
+	split_member = NULL;
+	delta_mode = 0;
+	flush_func = NULL;
+	digest = NULL;
+	reader = NULL;
+	counting = 0;
 	return 1;
 }
 
+static void
+leave_callback(void)
+{
+	const struct saved_state *s = &saved[--callback_depth];
+	remaining_length = s->remaining_length;
+	truncate_mode = s->truncate_mode;
+	truncated = s->truncated;
+	omitted_elements = s->omitted_elements;
+	split_member = s->split_member;
+	split_first = s->split_first;
+	split_next = s->split_next;
+	split_budget = s->split_budget;
+	priority_level = s->priority_level;
+	priority_budget = s->priority_budget;
+	delta_mode = s->delta_mode;
+	delta_since = s->delta_since;
+	buf_start = s->buf_start;
+	buf_len = s->buf_len;
+	flushed = s->flushed;
+	flush_func = s->flush_func;
+	sink_func = s->sink_func;
+	sink_arg = s->sink_arg;
+	digest = s->digest;
+	digest_end = s->digest_end;
+	reader = s->reader;
+	depth = s->depth;
+	resume_next = s->resume_next;
+	part_buf = s->part_buf;
+	part_size = s->part_size;
+	part_len = s->part_len;
+	part_offset = s->part_offset;
+	counting = s->counting;
+}
+
+static const uint32_t crc32c_table[256] = {
+	0x00000000, 0xF26B8303, 0xE13B70F7, 0x1350F3F4,
+	0xC79A971F, 0x35F1141C, 0x26A1E7E8, 0xD4CA64EB,
+	0x8AD958CF, 0x78B2DBCC, 0x6BE22838, 0x9989AB3B,
+	0x4D43CFD0, 0xBF284CD3, 0xAC78BF27, 0x5E133C24,
+	0x105EC76F, 0xE235446C, 0xF165B798, 0x030E349B,
+	0xD7C45070, 0x25AFD373, 0x36FF2087, 0xC494A384,
+	0x9A879FA0, 0x68EC1CA3, 0x7BBCEF57, 0x89D76C54,
+	0x5D1D08BF, 0xAF768BBC, 0xBC267848, 0x4E4DFB4B,
+	0x20BD8EDE, 0xD2D60DDD, 0xC186FE29, 0x33ED7D2A,
+	0xE72719C1, 0x154C9AC2, 0x061C6936, 0xF477EA35,
+	0xAA64D611, 0x580F5512, 0x4B5FA6E6, 0xB93425E5,
+	0x6DFE410E, 0x9F95C20D, 0x8CC531F9, 0x7EAEB2FA,
+	0x30E349B1, 0xC288CAB2, 0xD1D83946, 0x23B3BA45,
+	0xF779DEAE, 0x05125DAD, 0x1642AE59, 0xE4292D5A,
+	0xBA3A117E, 0x4851927D, 0x5B016189, 0xA96AE28A,
+	0x7DA08661, 0x8FCB0562, 0x9C9BF696, 0x6EF07595,
+	0x417B1DBC, 0xB3109EBF, 0xA0406D4B, 0x522BEE48,
+	0x86E18AA3, 0x748A09A0, 0x67DAFA54, 0x95B17957,
+	0xCBA24573, 0x39C9C670, 0x2A993584, 0xD8F2B687,
+	0x0C38D26C, 0xFE53516F, 0xED03A29B, 0x1F682198,
+	0x5125DAD3, 0xA34E59D0, 0xB01EAA24, 0x42752927,
+	0x96BF4DCC, 0x64D4CECF, 0x77843D3B, 0x85EFBE38,
+	0xDBFC821C, 0x2997011F, 0x3AC7F2EB, 0xC8AC71E8,
+	0x1C661503, 0xEE0D9600, 0xFD5D65F4, 0x0F36E6F7,
+	0x61C69362, 0x93AD1061, 0x80FDE395, 0x72966096,
+	0xA65C047D, 0x5437877E, 0x4767748A, 0xB50CF789,
+	0xEB1FCBAD, 0x197448AE, 0x0A24BB5A, 0xF84F3859,
+	0x2C855CB2, 0xDEEEDFB1, 0xCDBE2C45, 0x3FD5AF46,
+	0x7198540D, 0x83F3D70E, 0x90A324FA, 0x62C8A7F9,
+	0xB602C312, 0x44694011, 0x5739B3E5, 0xA55230E6,
+	0xFB410CC2, 0x092A8FC1, 0x1A7A7C35, 0xE811FF36,
+	0x3CDB9BDD, 0xCEB018DE, 0xDDE0EB2A, 0x2F8B6829,
+	0x82F63B78, 0x709DB87B, 0x63CD4B8F, 0x91A6C88C,
+	0x456CAC67, 0xB7072F64, 0xA457DC90, 0x563C5F93,
+	0x082F63B7, 0xFA44E0B4, 0xE9141340, 0x1B7F9043,
+	0xCFB5F4A8, 0x3DDE77AB, 0x2E8E845F, 0xDCE5075C,
+	0x92A8FC17, 0x60C37F14, 0x73938CE0, 0x81F80FE3,
+	0x55326B08, 0xA759E80B, 0xB4091BFF, 0x466298FC,
+	0x1871A4D8, 0xEA1A27DB, 0xF94AD42F, 0x0B21572C,
+	0xDFEB33C7, 0x2D80B0C4, 0x3ED04330, 0xCCBBC033,
+	0xA24BB5A6, 0x502036A5, 0x4370C551, 0xB11B4652,
+	0x65D122B9, 0x97BAA1BA, 0x84EA524E, 0x7681D14D,
+	0x2892ED69, 0xDAF96E6A, 0xC9A99D9E, 0x3BC21E9D,
+	0xEF087A76, 0x1D63F975, 0x0E330A81, 0xFC588982,
+	0xB21572C9, 0x407EF1CA, 0x532E023E, 0xA145813D,
+	0x758FE5D6, 0x87E466D5, 0x94B49521, 0x66DF1622,
+	0x38CC2A06, 0xCAA7A905, 0xD9F75AF1, 0x2B9CD9F2,
+	0xFF56BD19, 0x0D3D3E1A, 0x1E6DCDEE, 0xEC064EED,
+	0xC38D26C4, 0x31E6A5C7, 0x22B65633, 0xD0DDD530,
+	0x0417B1DB, 0xF67C32D8, 0xE52CC12C, 0x1747422F,
+	0x49547E0B, 0xBB3FFD08, 0xA86F0EFC, 0x5A048DFF,
+	0x8ECEE914, 0x7CA56A17, 0x6FF599E3, 0x9D9E1AE0,
+	0xD3D3E1AB, 0x21B862A8, 0x32E8915C, 0xC083125F,
+	0x144976B4, 0xE622F5B7, 0xF5720643, 0x07198540,
+	0x590AB964, 0xAB613A67, 0xB831C993, 0x4A5A4A90,
+	0x9E902E7B, 0x6CFBAD78, 0x7FAB5E8C, 0x8DC0DD8F,
+	0xE330A81A, 0x115B2B19, 0x020BD8ED, 0xF0605BEE,
+	0x24AA3F05, 0xD6C1BC06, 0xC5914FF2, 0x37FACCF1,
+	0x69E9F0D5, 0x9B8273D6, 0x88D28022, 0x7AB90321,
+	0xAE7367CA, 0x5C18E4C9, 0x4F48173D, 0xBD23943E,
+	0xF36E6F75, 0x0105EC76, 0x12551F82, 0xE03E9C81,
+	0x34F4F86A, 0xC69F7B69, 0xD5CF889D, 0x27A40B9E,
+	0x79B737BA, 0x8BDCB4B9, 0x988C474D, 0x6AE7C44E,
+	0xBE2DA0A5, 0x4C4623A6, 0x5F16D052, 0xAD7D5351,
+};
+
+static uint32_t
+crc32c_sw(uint32_t crc, const unsigned char *p, size_t len)
+{
+	while (len--)
+		crc = crc32c_table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+	return crc;
+}
+
+#if defined(CRC32C_SSE42)
+__attribute__((target("sse4.2")))
+static uint32_t
+crc32c_hw(uint32_t crc, const unsigned char *p, size_t len)
+{
+	uint64_t c = crc;
+	for ( ; len >= 8; len -= 8, p += 8){
+		uint64_t v;
+		memcpy(&v, p, 8);
+		c = _mm_crc32_u64(c, v);
+	}
+	crc = (uint32_t)c;
+	for ( ; len; len--)
+		crc = _mm_crc32_u8(crc, *p++);
+	return crc;
+}
+#elif defined(CRC32C_ARM)
+static uint32_t
+crc32c_hw(uint32_t crc, const unsigned char *p, size_t len)
+{
+	for ( ; len >= 8; len -= 8, p += 8){
+		uint64_t v;
+		memcpy(&v, p, 8);
+		crc = __crc32cd(crc, v);
+	}
+	for ( ; len; len--)
+		crc = __crc32cb(crc, *p++);
+	return crc;
+}
+#endif
+
+static uint32_t
+crc32c(uint32_t crc, const unsigned char *p, size_t len)
+{
+	crc = ~crc;
+#if defined(CRC32C_SSE42)
+	if (__builtin_cpu_supports("sse4.2"))
+		return ~crc32c_hw(crc, p, len);
+#elif defined(CRC32C_ARM)
+	return ~crc32c_hw(crc, p, len);
+#endif
+	return ~crc32c_sw(crc, p, len);
+}
+
+static uint64_t
+fnv1a(uint64_t hash, const unsigned char *p, size_t len)
+{
+	while (len--){
+		hash ^= *p++;
+		hash *= 0x100000001B3;
+	}
+	return hash;
+}
+
+static void
+digest_update(const char *data, size_t len)
+{
+	const unsigned char *p = (const unsigned char*)data;
+	if (digest->types & json_digest_crc32c)
+		digest->crc32c = crc32c(digest->crc32c, p, len);
+	if (digest->types & json_digest_hash)
+		digest->hash = fnv1a(digest->hash, p, len);
+}
+
+static void
+digest_init(struct json_digest *d)
+{
+	d->crc32c = 0;
+	d->hash = 0xCBF29CE484222325;
+	digest = d;
+}
+
+/*
+ * Flushes the buffer and returns the new output position if there is room for
+ * 'len' bytes afterwards, NULL otherwise.
+ */
+static char*
+flush(char *out, size_t len)
+{
+	if (!flush_func){
+		truncated = truncate_mode;
+		return NULL;
+	}
+
+	/* Bytes reserved for closing brackets stay reserved */
+	size_t used = (size_t)(out - buf_start);
+	size_t reserved = buf_len - used - remaining_length;
+	if (digest)
+		digest_update(buf_start, used);
+	if ((*flush_func)(buf_start, used))
+		return NULL;
+
+	flushed += used;
+	if (buf_len < reserved + len)
+		return NULL;
+	remaining_length = buf_len - reserved;
+	return buf_start;
+}
+
+/* Reserves 'len' bytes and returns the output position or NULL */
+static char*
+reserve(char *out, size_t len)
+{
+	if (remaining_length < len && !(out = flush(out, len)))
+		return NULL;
+	remaining_length -= len;
+	return out;
+}
+
 static char*
 strcpy_val(char *out, const char *val, size_t len)
 {
-	if (!reduce_rem_len(len))
+	/* Copy as much as possible if the buffer can be flushed */
+	while (remaining_length < len && flush_func){
+		size_t n = remaining_length;
+		memcpy(out, val, n);
+		val += n;
+		len -= n;
+		remaining_length = 0;
+		if (!(out = flush(out + n, 1)))
+			return NULL;
+	}
+
+	if (!(out = reserve(out, len)))
 		return NULL;
 	memcpy(out, val, len);
 	return out + len;
 }
 
+/* Writes an opening bracket and reserves the closing one, unless counting */
+static char*
+open_container(char *out, char c)
+{
+	if (!(out = reserve(out, counting ? 1 : 2)))
+		return NULL;
+	*out++ = c;
+	return out;
+}
+
+static char*
+close_container(char *out, char c)
+{
+	if (counting && !(out = reserve(out, 1)))
+		return NULL;
+	*out++ = c;
+	return out;
+}
+
 static char*
 gen_null(char *out, const void *val)
 {
@@ -105,67 +518,66 @@ gen_boolean(char *out, const void *val)
 }
 
 static char*
-gen_string(char *out, const void *val)
+gen_string_len(char *out, const char *val, size_t len)
 {
-	if (!val)
-		return gen_null(out, val);
-
-	if (!reduce_rem_len(2)) // 2 -> ""
+	if (!(out = reserve(out, 2))) // 2 -> ""
 		return NULL;
 
-	char chars_to_escape[] = "\"\\";
-	const char *begin = (const char*)val;
-	const char *end = begin + strlen(begin);
+	const char *begin = val;
+	const char *end = val + len;
+
+	/* Next character to escape of each kind, found with memchr() */
+	const char *quote = memchr(val, '"', len);
+	const char *bslash = memchr(val, '\\', len);
 
 	*out++ = '"';
-	char *esc;
-	do {
-		esc = NULL;
-		for (int i = 0; i < 2; i++) {
-			char *tmp;
-			if ((tmp = strchr(begin, chars_to_escape[i]))) {
-				if (!esc)
-					esc = tmp;
-				else
-					esc = esc < tmp ? esc : tmp;
-			}
+	while (quote || bslash){
+		const char *esc;
+		if (quote && (!bslash || quote < bslash)){
+			esc = quote;
+			quote = memchr(esc + 1, '"', (size_t)(end - esc - 1));
+		} else {
+			esc = bslash;
+			bslash = memchr(esc + 1, '\\', (size_t)(end - esc - 1));
 		}
 
-		size_t len = esc ? (size_t)(esc - begin) : (size_t)(end - begin);
-
-		if (!(out = strcpy_val(out, begin, len)))
+		/* The escaped character starts the next run */
+		if (!(out = strcpy_val(out, begin, (size_t)(esc - begin))))
 			return NULL;
+		if (!(out = reserve(out, 1)))
+			return NULL;
+		*out++ = '\\';
+		begin = esc;
+	}
 
-		if (esc) {
-			char s[2];
-			s[0] = '\\';
-			s[1] = *esc;
-			if (!(out = strcpy_val(out, s, 2)))
-				return NULL;
-			begin = esc + 1;
-		}
-
-	} while (esc && *begin);
+	if (!(out = strcpy_val(out, begin, (size_t)(end - begin))))
+		return NULL;
 
 	*out++ = '"';
 	return out;
 }
 
 static char*
-mtojson_utoa(char *dst, unsigned n, unsigned base)
+gen_string(char *out, const void *val)
 {
-	char *s = dst;
-	char *e;
+	if (!val)
+		return gen_null(out, val);
+
+	return gen_string_len(out, (const char*)val, strlen((const char*)val));
+}
 
+static char*
+mtojson_utoa(char *dst, unsigned n, unsigned base)
+{
+	size_t len = 1;
 	for (unsigned m = n; m >= base;  m /= base)
-		s++;
-	e = s + 1;
+		len++;
 
-	size_t len = (size_t)(e - dst);
-	if (!reduce_rem_len(len))
+	if (!(dst = reserve(dst, len)))
 		return NULL;
 
-	for ( ; s >= dst; s--, n /= base)
+	char *e = dst + len;
+	for (char *s = e - 1; s >= dst; s--, n /= base)
 		*s = "0123456789ABCDEF"[n % base];
 	return e;
 }
@@ -173,18 +585,15 @@ mtojson_utoa(char *dst, unsigned n, unsigned base)
 static char*
 mtojson_ultoa(char *dst, unsigned long n, unsigned base)
 {
-	char *s = dst;
-	char *e;
-
+	size_t len = 1;
 	for (unsigned long m = n; m >= base;  m /= base)
-		s++;
-	e = s + 1;
+		len++;
 
-	size_t len = (size_t)(e - dst);
-	if (!reduce_rem_len(len))
+	if (!(dst = reserve(dst, len)))
 		return NULL;
 
-	for ( ; s >= dst; s--, n /= base)
+	char *e = dst + len;
+	for (char *s = e - 1; s >= dst; s--, n /= base)
 		*s = "0123456789ABCDEF"[n % base];
 	return e;
 }
@@ -192,18 +601,15 @@ mtojson_ultoa(char *dst, unsigned long n, unsigned base)
 static char*
 mtojson_ulltoa(char *dst, unsigned long long n, unsigned base)
 {
-	char *s = dst;
-	char *e;
-
+	size_t len = 1;
 	for (unsigned long long m = n; m >= base;  m /= base)
-		s++;
-	e = s + 1;
+		len++;
 
-	size_t len = (size_t)(e - dst);
-	if (!reduce_rem_len(len))
+	if (!(dst = reserve(dst, len)))
 		return NULL;
 
-	for ( ; s >= dst; s--, n /= base)
+	char *e = dst + len;
+	for (char *s = e - 1; s >= dst; s--, n /= base)
 		*s = "0123456789ABCDEF"[n % base];
 	return e;
 }
@@ -214,7 +620,7 @@ gen_hex(char *out, const void *val)
 	if (!val)
 		return gen_null(out, val);
 
-	if (!reduce_rem_len(2)) // 2 -> ""
+	if (!(out = reserve(out, 2))) // 2 -> ""
 		return NULL;
 
 	*out++ = '"';
@@ -231,7 +637,7 @@ gen_hex_u8(char *out, const void *val)
 	if (!val)
 		return gen_null(out, val);
 
-	if (!reduce_rem_len(2)) // 2 -> ""
+	if (!(out = reserve(out, 2))) // 2 -> ""
 		return NULL;
 
 	*out++ = '"';
@@ -248,7 +654,7 @@ gen_hex_u16(char *out, const void *val)
 	if (!val)
 		return gen_null(out, val);
 
-	if (!reduce_rem_len(2)) // 2 -> ""
+	if (!(out = reserve(out, 2))) // 2 -> ""
 		return NULL;
 
 	*out++ = '"';
@@ -265,7 +671,7 @@ gen_hex_u32(char *out, const void *val)
 	if (!val)
 		return gen_null(out, val);
 
-	if (!reduce_rem_len(2)) // 2 -> ""
+	if (!(out = reserve(out, 2))) // 2 -> ""
 		return NULL;
 
 	*out++ = '"';
@@ -282,7 +688,7 @@ gen_hex_u64(char *out, const void *val)
 	if (!val)
 		return gen_null(out, val);
 
-	if (!reduce_rem_len(2)) // 2 -> ""
+	if (!(out = reserve(out, 2))) // 2 -> ""
 		return NULL;
 
 	*out++ = '"';
@@ -302,7 +708,7 @@ gen_int(char *out, const void *val)
 	int n = *(const int*)val;
 	unsigned u = (unsigned)n;
 	if (n < 0){
-		if (!reduce_rem_len(1))
+		if (!(out = reserve(out, 1)))
 			return NULL;
 		*out++ = '-';
 		u = -(unsigned)n;
@@ -320,7 +726,7 @@ gen_int8_t(char *out, const void *val)
 	int n = *(const int8_t*)val;
 	unsigned u = (unsigned)n;
 	if (n < 0){
-		if (!reduce_rem_len(1))
+		if (!(out = reserve(out, 1)))
 			return NULL;
 		*out++ = '-';
 		u = -(unsigned)n;
@@ -338,7 +744,7 @@ gen_int16_t(char *out, const void *val)
 	int n = *(const int16_t*)val;
 	unsigned u = (unsigned)n;
 	if (n < 0){
-		if (!reduce_rem_len(1))
+		if (!(out = reserve(out, 1)))
 			return NULL;
 		*out++ = '-';
 		u = -(unsigned)n;
@@ -356,7 +762,7 @@ gen_int32_t(char *out, const void *val)
 	int n = *(const int*)val;
 	unsigned u = (unsigned)n;
 	if (n < 0){
-		if (!reduce_rem_len(1))
+		if (!(out = reserve(out, 1)))
 			return NULL;
 		*out++ = '-';
 		u = -(unsigned)n;
@@ -374,7 +780,7 @@ gen_int64_t(char *out, const void *val)
 	int64_t n = *(const int64_t*)val;
 	uint64_t u = (uint64_t)n;
 	if (n < 0){
-		if (!reduce_rem_len(1))
+		if (!(out = reserve(out, 1)))
 			return NULL;
 		*out++ = '-';
 		u = -(uint64_t)n;
@@ -437,7 +843,7 @@ gen_long(char *out, const void *val)
 	long n = *(const long*)val;
 	unsigned long u = (unsigned long)n;
 	if (n < 0){
-		if (!reduce_rem_len(1))
+		if (!(out = reserve(out, 1)))
 			return NULL;
 		*out++ = '-';
 		u = -(unsigned long)n;
@@ -455,7 +861,7 @@ gen_longlong(char *out, const void *val)
 	long long n = *(const long long*)val;
 	unsigned long long u = (unsigned long long)n;
 	if (n < 0){
-		if (!reduce_rem_len(1))
+		if (!(out = reserve(out, 1)))
 			return NULL;
 		*out++ = '-';
 		u = -(unsigned long long)n;
@@ -489,115 +895,216 @@ gen_value(char *out, const void *val)
 	return strcpy_val(out, (const char*)val, strlen((const char*)val));
 }
 
-static char*
-gen_c_array(char *out, const void *val)
+/* Returns the size of a C array element of type 'vtype' or 0 if unsupported. */
+static size_t
+c_array_incr(enum json_to_type vtype)
 {
-	const struct to_json *tjs = (const struct to_json*)val;
-	if (!reduce_rem_len(2)) // 2 -> []
-		return NULL;
-
-	*out++ = '[';
-	if (*tjs->count == 0){
-		*out++ = ']';
-		return out;
-	}
-
-	size_t incr = 0;
-	char* (*func)(char *, const void *) = gen_functions[tjs->vtype];
-	switch (tjs->vtype) {
+	switch (vtype) {
 	case t_to_boolean:
-		incr = sizeof(_Bool);
-		break;
+		return sizeof(_Bool);
 
 	case t_to_int:
-		incr = sizeof(int);
-		break;
+		return sizeof(int);
 
 	case t_to_int8_t:
-		incr = sizeof(int8_t);
-		break;
+		return sizeof(int8_t);
 
 	case t_to_int16_t:
-		incr = sizeof(int16_t);
-		break;
+		return sizeof(int16_t);
 
 	case t_to_int32_t:
-		incr = sizeof(int32_t);
-		break;
+		return sizeof(int32_t);
 
 	case t_to_int64_t:
-		incr = sizeof(int64_t);
-		break;
+		return sizeof(int64_t);
 
 	case t_to_long:
-		incr = sizeof(unsigned long);
-		break;
+		return sizeof(unsigned long);
 
 	case t_to_longlong:
-		incr = sizeof(unsigned long long);
-		break;
+		return sizeof(unsigned long long);
+
+	case t_to_map:
+		return sizeof(struct to_json_map);
 
 	case t_to_object:
-		incr = sizeof(struct to_json);
-		break;
+		return sizeof(struct to_json);
 
 	case t_to_hex:
 	case t_to_uint:
-		incr = sizeof(unsigned);
-		break;
+		return sizeof(unsigned);
 
 	case t_to_hex_u8:
 	case t_to_uint8_t:
-		incr = sizeof(uint8_t);
-		break;
+		return sizeof(uint8_t);
 
 	case t_to_hex_u16:
 	case t_to_uint16_t:
-		incr = sizeof(uint16_t);
-		break;
+		return sizeof(uint16_t);
 
 	case t_to_hex_u32:
 	case t_to_uint32_t:
-		incr = sizeof(uint32_t);
-		break;
+		return sizeof(uint32_t);
 
 	case t_to_hex_u64:
 	case t_to_uint64_t:
-		incr = sizeof(uint64_t);
-		break;
+		return sizeof(uint64_t);
 
 	case t_to_ulong:
-		incr = sizeof(unsigned long);
-		break;
+		return sizeof(unsigned long);
 
 	case t_to_ulonglong:
-		incr = sizeof(unsigned long long);
-		break;
+		return sizeof(unsigned long long);
 
 	case t_to_array:
+	case t_to_const:
 	case t_to_null:
 	case t_to_primitive:
 	case t_to_string:
 	case t_to_value:
+		return 0;
+	}
+	return 0;
+}
+
+/*
+ * Enters a container in reader mode and returns the index of the first element
+ * to generate. When resuming, the containers on the saved path continue at the
+ * saved element and the offset is set to where it started.
+ */
+static size_t
+enter_container(char *out)
+{
+	size_t first = 0;
+	if (depth == resume_next && depth < reader->depth){
+		first = reader->index[depth];
+		flushed = reader->start[depth] - (size_t)(out - buf_start);
+		resume_next++;
+	}
+	depth++;
+	return first;
+}
+
+/* Saves the position of element 'i' at 'out' in reader mode */
+static void
+mark_element(char *out, size_t i)
+{
+	if (depth > JSON_READER_DEPTH)
+		return;
+	reader->index[depth - 1] = i;
+	reader->start[depth - 1] = flushed + (size_t)(out - buf_start);
+}
+
+static char*
+gen_comma(char *out, size_t i)
+{
+	if (!i)
+		return out;
+
+	if (!(out = reserve(out, 1)))
+		return NULL;
+	*out++ = ',';
+	return out;
+}
+
+/*
+ * Checks the result 'end' of an element generated at 'out'. In truncating mode
+ * a failed element is dropped and the remaining length is restored to 'rem'.
+ */
+static char*
+elem_done(char *out, char *end, size_t rem)
+{
+	if (end)
+		return end;
+	if (!truncated)
+		return NULL;
+
+	remaining_length = rem;
+	omitted_elements++;
+	return out;
+}
+
+static char*
+gen_c_array_elem(char *out, char* (*func)(char *, const void *),
+		const void *val, size_t i)
+{
+	if (!(out = gen_comma(out, i)))
+		return NULL;
+	return (*func)(out, val);
+}
+
+/*
+ * Generates the elements of the split C array starting at 'split_first' until
+ * 'split_budget' is exhausted.
+ */
+static char*
+gen_c_array_split(char *out, const struct to_json *tjs)
+{
+	if (!(out = open_container(out, '[')))
 		return NULL;
+	size_t incr = c_array_incr(tjs->vtype);
+	const char *p = tjs->value;
+	size_t budget = split_budget;
+	size_t i;
+	for (i = split_first; i < *tjs->count; i++){
+		size_t rem = remaining_length;
+		char *end = gen_c_array_elem(out, gen_functions[tjs->vtype],
+				p + i * incr, i - split_first);
+		if (!end || (size_t)(end - out) > budget){
+			remaining_length = rem;
+			break;
+		}
+		budget -= (size_t)(end - out);
+		out = end;
 	}
+	split_next = i;
+
+	return close_container(out, ']');
+}
+
+static char*
+gen_c_array(char *out, const void *val)
+{
+	const struct to_json *tjs = (const struct to_json*)val;
+	if (tjs == split_member)
+		return gen_c_array_split(out, tjs);
+
+	if (!(out = open_container(out, '[')))
+		return NULL;
+	if (*tjs->count == 0)
+		return close_container(out, ']');
+
+	size_t incr = c_array_incr(tjs->vtype);
+	if (!incr)
+		return NULL;
 
 	const char *p = tjs->value;
-	for (size_t i = 0; i < *tjs->count - 1; i++){
-		if (!(out = (*func)(out, p)))
-			return NULL;
-		if (!reduce_rem_len(1))
+	size_t i = reader ? enter_container(out) : 0;
+	for (; i < *tjs->count; i++){
+		if (truncated){
+			omitted_elements += *tjs->count - i;
+			break;
+		}
+		if (reader)
+			mark_element(out, i);
+		size_t rem = remaining_length;
+		char *end = gen_c_array_elem(out, gen_functions[tjs->vtype],
+				p + i * incr, i);
+		if (!(out = elem_done(out, end, rem)))
 			return NULL;
-		*out++ = ',';
-
-		p += incr;
 	}
+	if (reader)
+		depth--;
 
-	if (!(out = (*func)(out, p)))
-		return NULL;
+	return close_container(out, ']');
+}
 
-	*out++ = ']';
-	return out;
+static char*
+gen_array_elem(char *out, const struct to_json *tjs, size_t i)
+{
+	if (!(out = gen_comma(out, i)))
+		return NULL;
+	return gen_primitive(out, tjs);
 }
 
 static char*
@@ -607,26 +1114,77 @@ gen_array(char *out, const void *val)
 		return gen_null(out, val);
 
 	const struct to_json *tjs = (const struct to_json*)val;
-	if (!reduce_rem_len(2)) // 2 -> []
+	if (!(out = open_container(out, '[')))
+		return NULL;
+	for (size_t i = reader ? enter_container(out) : 0; tjs[i].value; i++){
+		if (truncated){
+			omitted_elements++;
+			continue;
+		}
+		if (reader)
+			mark_element(out, i);
+		size_t rem = remaining_length;
+		char *end = gen_array_elem(out, &tjs[i], i);
+		if (!(out = elem_done(out, end, rem)))
+			return NULL;
+	}
+	if (reader)
+		depth--;
+	return close_container(out, ']');
+}
+
+static char*
+gen_object_member(char *out, const struct to_json *tjs, size_t i)
+{
+	if (!(out = gen_comma(out, i)))
 		return NULL;
 
-	*out++ = '[';
-	while (tjs->value){
-		if (tjs->count)
-			out = gen_c_array(out, tjs);
-		else
-			out = gen_functions[tjs->vtype](out, tjs->value);
+	if (!(out = reserve(out, 3))) // 3 -> "":
+		return NULL;
+
+	*out++ = '"';
+	if (!(out = strcpy_val(out, tjs->name, strlen(tjs->name))))
+		return NULL;
+	*out++ = '"';
+	*out++ = ':';
+
+	return gen_primitive(out, tjs);
+}
+
+/* Returns whether the member 'tjs' changed after 'delta_since' */
+static _Bool
+delta_changed(const struct to_json *tjs)
+{
+	if (tjs->version)
+		return *tjs->version > delta_since;
+	if (tjs->vtype != t_to_object || tjs->count || !tjs->value)
+		return 0;
+
+	for (const struct to_json *m = tjs->value; m->name; m++)
+		if (delta_changed(m))
+			return 1;
+	return 0;
+}
+
+static char*
+gen_object_delta(char *out, const struct to_json *tjs)
+{
+	if (!(out = open_container(out, '{')))
+		return NULL;
+	size_t n = 0;
+	for ( ; tjs->name; tjs++){
+		if (!delta_changed(tjs))
+			continue;
+
+		/* Versioned members are generated completely */
+		delta_mode = !tjs->version;
+		out = gen_object_member(out, tjs, n++);
+		delta_mode = 1;
 		if (!out)
 			return NULL;
-		tjs++;
-		if (tjs->value){
-			if (!reduce_rem_len(1))
-				return NULL;
-			*out++ = ',';
-		}
 	}
-	*out++ = ']';
-	return out;
+
+	return close_container(out, '}');
 }
 
 static char*
@@ -636,41 +1194,125 @@ gen_object(char *out, const void *val)
 		return gen_null(out, val);
 
 	const struct to_json *tjs = (const struct to_json*)val;
+	if (delta_mode)
+		return gen_object_delta(out, tjs);
 
-	if (!reduce_rem_len(2)) // 2 -> {}
+	if (!(out = open_container(out, '{')))
 		return NULL;
-
-	*out++ = '{';
-	while (tjs->name){
-		const char *name = tjs->name;
-		size_t len = strlen(name);
-		if (!reduce_rem_len(len + 3)) // 3 -> "":
+	for (size_t i = reader ? enter_container(out) : 0; tjs[i].name; i++){
+		if (truncated){
+			omitted_elements++;
+			continue;
+		}
+		if (reader)
+			mark_element(out, i);
+		size_t rem = remaining_length;
+		char *end = gen_object_member(out, &tjs[i], i);
+		if (!(out = elem_done(out, end, rem)))
 			return NULL;
+	}
+	if (reader)
+		depth--;
 
-		*out++ = '"';
-		memcpy(out, name, len);
-		out += len;
-		*out++ = '"';
-		*out++ = ':';
+	return close_container(out, '}');
+}
 
-		if (tjs->count)
-			out =  gen_c_array(out, tjs);
-		else
-			out =  gen_functions[tjs->vtype](out, tjs->value);
+/* Values of these types are stored as pointers in a map */
+static _Bool
+map_value_indirect(enum json_to_type vtype)
+{
+	switch (vtype) {
+	case t_to_array:
+	case t_to_map:
+	case t_to_object:
+	case t_to_string:
+	case t_to_value:
+		return 1;
+	default:
+		return 0;
+	}
+}
 
-		if (!out)
-			return NULL;
+static char*
+gen_map_entry(char *out, const struct to_json_map *map, const void *val,
+		size_t i)
+{
+	if (!(out = gen_comma(out, i)))
+		return NULL;
 
-		tjs++;
-		if (tjs->name){
-			if (!reduce_rem_len(1))
-				return NULL;
-			*out++ = ',';
+	const char *key = map->keys[i];
+	size_t len = map->key_lens ? map->key_lens[i] : strlen(key);
+	if (!(out = gen_string_len(out, key, len)))
+		return NULL;
+	if (!(out = reserve(out, 1)))
+		return NULL;
+	*out++ = ':';
+
+	if (map_value_indirect(map->vtype))
+		val = *(const void * const*)val;
+	return gen_functions[map->vtype](out, val);
+}
+
+static char*
+gen_map(char *out, const void *val)
+{
+	if (!val)
+		return gen_null(out, val);
+
+	const struct to_json_map *map = (const struct to_json_map*)val;
+	size_t incr = map_value_indirect(map->vtype) ? sizeof(const void*)
+		: c_array_incr(map->vtype);
+	if (!incr)
+		return NULL;
+
+	if (!(out = open_container(out, '{')))
+		return NULL;
+	size_t i = reader ? enter_container(out) : 0;
+	const char *p = (const char*)map->values + i * incr;
+	for (; i < *map->count; i++, p += incr){
+		if (truncated){
+			omitted_elements += *map->count - i;
+			break;
 		}
+		if (reader)
+			mark_element(out, i);
+		size_t rem = remaining_length;
+		if (!(out = elem_done(out, gen_map_entry(out, map, p, i), rem)))
+			return NULL;
 	}
+	if (reader)
+		depth--;
 
-	*out++ = '}';
-	return out;
+	return close_container(out, '}');
+}
+
+/*
+ * Copies the text of a constant subtree. If it was not generated before, it is
+ * generated to the output and saved if it was not flushed or dropped in the
+ * meantime.
+ */
+static char*
+gen_const(char *out, const void *val)
+{
+	if (!val)
+		return gen_null(out, val);
+
+	const struct to_json_const *c = (const struct to_json_const*)val;
+	if (c->len)
+		return strcpy_val(out, c->text, c->len);
+	if (c->buf_len && *c->buf_len)
+		return strcpy_val(out, c->buf, *c->buf_len);
+
+	size_t before = flushed + omitted_elements;
+	char *end = gen_document(out, c->tjs);
+	if (!end || !c->buf_len || flushed + omitted_elements != before
+			|| (size_t)(end - out) >= c->size)
+		return end;
+
+	memcpy(c->buf, out, (size_t)(end - out));
+	c->buf[end - out] = '\0';
+	*c->buf_len = (size_t)(end - out);
+	return end;
 }
 
 static char*
@@ -683,25 +1325,163 @@ gen_primitive(char *out, const void *to_json)
 	return gen_functions[tjs->vtype](out, tjs->value);
 }
 
-size_t
-json_generate(char *out, const struct to_json *tjs, size_t len)
+/*
+ * Returns the length of a member generated into 'out' or 'len' if it does not
+ * fit
+ */
+static size_t
+measure_member(char *out, const struct to_json *tjs, size_t len)
 {
-	const char *start = out;
-
 	remaining_length = len;
-	if (!reduce_rem_len(1)) // \0
+	char *end = gen_primitive(out, tjs);
+	if (!end)
+		return len;
+	return strlen(tjs->name) + 3 + (size_t)(end - out); // 3 -> "":
+}
+
+/*
+ * Returns the lowest priority above 'level' or UCHAR_MAX + 1 if there is
+ * none
+ */
+static unsigned
+next_priority(const struct to_json *tjs, unsigned level)
+{
+	unsigned next = UCHAR_MAX + 1;
+	for ( ; tjs->name; tjs++)
+		if (tjs->priority > level && tjs->priority < next)
+			next = tjs->priority;
+	return next;
+}
+
+/*
+ * Returns the size of all members with priority 'level', including a comma for
+ * each member. Uses 'out' with 'len' bytes as scratch space.
+ */
+static size_t
+level_size(char *out, const struct to_json *tjs, unsigned level, size_t len)
+{
+	size_t sum = 0;
+	for ( ; tjs->name; tjs++)
+		if (tjs->priority == level)
+			sum += measure_member(out, tjs, len) + 1;
+	return sum;
+}
+
+/*
+ * Generates an object with all members with a priority below 'priority_level'
+ * and as many members with priority 'priority_level' as fit into
+ * 'priority_budget'.
+ */
+static char*
+gen_object_prioritized(char *out, const struct to_json *tjs)
+{
+	if (!(out = open_container(out, '{')))
+		return NULL;
+	size_t n = 0;
+	for ( ; tjs->name; tjs++){
+		if (tjs->priority > priority_level){
+			omitted_elements++;
+			continue;
+		}
+
+		size_t rem = remaining_length;
+		char *end = gen_object_member(out, tjs, n);
+		if (tjs->priority == priority_level){
+			/* Account for a comma like level_size() */
+			size_t used = end ? (size_t)(end - out) + !n : 0;
+			if (!end || used > priority_budget){
+				remaining_length = rem;
+				omitted_elements++;
+				continue;
+			}
+			priority_budget -= used;
+		}
+
+		if (!(out = end))
+			return NULL;
+		n++;
+	}
+
+	return close_container(out, '}');
+}
+
+static size_t
+generate_prioritized(char *out, const struct to_json *tjs, size_t len)
+{
+	/* Find the first level which does not fit completely */
+	priority_budget = len - 2; // 2 -> {}
+	priority_level = 0;
+	while (priority_level <= UCHAR_MAX){
+		size_t size = level_size(out, tjs, priority_level, len);
+		if (size > priority_budget)
+			break;
+		priority_budget -= size;
+		priority_level = next_priority(tjs, priority_level);
+	}
+	if (priority_level == 0)
+		return 0;
+
+	remaining_length = len - 1; // \0
+	char *end = gen_object_prioritized(out, tjs);
+	if (!end)
 		return 0;
 
+	*end = '\0';
+	return (size_t)(end - out);
+}
+
+/*
+ * Returns the length of the n-th element of 'split_member' generated into
+ * 'out'
+ */
+static size_t
+measure_split_elem(char *out, size_t n, size_t len)
+{
+	const struct to_json *tjs = split_member;
+	const char *p = (const char*)tjs->value + n * c_array_incr(tjs->vtype);
+
+	remaining_length = len;
+	char *end = gen_functions[tjs->vtype](out, p);
+	return end ? (size_t)(end - out) : len;
+}
+
+/*
+ * Returns the number of documents needed for 'split_member' if every document
+ * has 'split_budget' bytes for the elements. Uses 'out' with 'len' bytes as
+ * scratch space.
+ */
+static unsigned
+count_chunks(char *out, size_t len)
+{
+	unsigned chunks = 1;
+	size_t used = 0;
+	for (size_t i = 0; i < *split_member->count; i++){
+		size_t size = measure_split_elem(out, i, len);
+		if (size > split_budget)
+			return 0;
+
+		if (i && used + 1 + size <= split_budget){
+			used += 1 + size; // 1 -> ,
+		} else {
+			if (i)
+				chunks++;
+			used = size;
+		}
+	}
+	return chunks;
+}
+
+/* Generates a complete JSON text of type 'tjs->stype' */
+static char*
+gen_document(char *out, const struct to_json *tjs)
+{
 	switch (tjs->stype) {
 	case t_to_array:
-		out = gen_array(out, tjs);
-		break;
+		return gen_array(out, tjs);
 	case t_to_object:
-		out = gen_object(out, tjs);
-		break;
+		return gen_object(out, tjs);
 	case t_to_primitive:
-		out = gen_primitive(out, tjs);
-		break;
+		return gen_primitive(out, tjs);
 	/* These are not valid ctypes */
 	case t_to_boolean:
 	case t_to_int:
@@ -710,12 +1490,585 @@ json_generate(char *out, const struct to_json *tjs, size_t len)
 	case t_to_uint:
 	case t_to_value:
 	default:
-		return 0;
+		return NULL;
 	}
+}
 
-	if (!out)
+static size_t
+generate(char *out, const struct to_json *tjs, size_t len)
+{
+	truncated = 0;
+	omitted_elements = 0;
+	buf_start = out;
+	buf_len = len;
+	flushed = 0;
+	remaining_length = len;
+	if (!(out = reserve(out, 1))) // \0
+		return 0;
+
+	if (!(out = gen_document(out, tjs)))
 		return 0;
 
 	*out = '\0';
-	return (size_t)(out - start);
+	if (digest)
+		digest_update(buf_start, (size_t)(out - buf_start));
+	return flushed + (size_t)(out - buf_start);
+}
+
+/* Keeps the output which fits into the caller's buffer and discards the rest */
+static int
+count_flush(const char *buf, size_t len)
+{
+	if (buf == count_buf)
+		return 0;
+
+	buf_start[len] = '\0';
+	buf_start = count_buf;
+	buf_len = sizeof(count_buf);
+	return 0;
+}
+
+size_t
+json_generate(char *out, const struct to_json *tjs, size_t len)
+{
+	truncate_mode = 0;
+	return generate(out, tjs, len);
+}
+
+size_t
+json_generate_size(char *out, const struct to_json *tjs, size_t len)
+{
+	truncate_mode = 0;
+	flush_func = count_flush;
+	counting = 1;
+	size_t l = len ? generate(out, tjs, len)
+		: generate(count_buf, tjs, sizeof(count_buf));
+	counting = 0;
+	flush_func = NULL;
+	return l;
+}
+
+static int
+stream_flush(const char *buf, size_t len)
+{
+	if (!len)
+		return 0;
+	if (!enter_callback())
+		return 1;
+	int ret = (*sink_func)(buf, len, sink_arg);
+	leave_callback();
+	return ret;
+}
+
+/*
+ * Digests the output in windows of this size while it is still in the cache.
+ * Space reserved for closing brackets is added to the window.
+ */
+enum { DIGEST_WINDOW = 256 };
+
+/* Moves the window forward */
+static int
+window_flush(const char *buf, size_t len)
+{
+	(void)buf;
+
+	size_t reserved = buf_len - len - remaining_length;
+	buf_start += len;
+	size_t left = (size_t)(digest_end - buf_start);
+	size_t window = reserved + DIGEST_WINDOW;
+	buf_len = left < window ? left : window;
+	return 0;
+}
+
+size_t
+json_generate_digest(char *out, const struct to_json *tjs, size_t len,
+		struct json_digest *d)
+{
+	truncate_mode = 0;
+	digest_init(d);
+	digest_end = out + len;
+	flush_func = window_flush;
+	size_t l = generate(out, tjs,
+			len < DIGEST_WINDOW ? len : DIGEST_WINDOW);
+	flush_func = NULL;
+	digest = NULL;
+	return l;
+}
+
+size_t
+json_generate_stream_digest(char *buf, const struct to_json *tjs, size_t len,
+		int (*sink)(const char *data, size_t len, void *arg), void *arg,
+		struct json_digest *d)
+{
+	digest_init(d);
+	size_t l = json_generate_stream(buf, tjs, len, sink, arg);
+	digest = NULL;
+	return l;
+}
+
+size_t
+json_generate_stream(char *buf, const struct to_json *tjs, size_t len,
+		int (*sink)(const char *data, size_t len, void *arg), void *arg)
+{
+	truncate_mode = 0;
+	sink_func = sink;
+	sink_arg = arg;
+	flush_func = stream_flush;
+	size_t l = generate(buf, tjs, len);
+	flush_func = NULL;
+
+	if (!l || stream_flush(buf_start, l - flushed))
+		return 0;
+	return l;
+}
+
+/*
+ * Discards the output before 'part_offset' and keeps the rest at the end of
+ * the part. The remaining space of 'part_buf' is used as buffer afterwards.
+ */
+static int
+part_flush(const char *buf, size_t len)
+{
+	size_t skip = 0;
+	if (flushed < part_offset)
+		skip = part_offset - flushed < len ?
+			part_offset - flushed : len;
+	if (skip == len)
+		return 0;
+
+	memmove(part_buf + part_len, buf + skip, len - skip);
+	part_len += len - skip;
+	buf_start = part_buf + part_len;
+	buf_len = part_size - part_len;
+	return 0;
+}
+
+size_t
+json_generate_part(char *buf, const struct to_json *tjs, size_t len,
+		size_t offset)
+{
+	truncate_mode = 0;
+	part_buf = buf;
+	part_size = len;
+	part_len = 0;
+	part_offset = offset;
+	flush_func = part_flush;
+	size_t l = generate(buf, tjs, len);
+	flush_func = NULL;
+
+	/* Generation stops with an error once the part is full, an error with
+	 * an empty part means the text can't be continued */
+	if (l)
+		part_flush(buf_start, l - flushed);
+	else if (!part_len)
+		return (size_t)-1;
+	if (part_len)
+		buf[part_len] = '\0';
+	return part_len;
+}
+
+void
+json_reader_init(struct json_reader *r, const struct to_json *tjs)
+{
+	r->tjs = tjs;
+	r->offset = 0;
+	r->depth = 0;
+}
+
+size_t
+json_reader_next(struct json_reader *r, char *buf, size_t len)
+{
+	reader = r;
+	depth = 0;
+	resume_next = 0;
+	size_t n = json_generate_part(buf, r->tjs, len, r->offset);
+	reader = NULL;
+	if (n == (size_t)-1)
+		return n;
+
+	/* The levels still open when the part was full */
+	r->depth = depth < JSON_READER_DEPTH ? depth : JSON_READER_DEPTH;
+	r->offset += n;
+	return n;
+}
+
+struct chunked {
+	char *data;
+	int (*write)(const char *data, size_t len, void *arg);
+	void *arg;
+};
+
+static size_t
+hex_len(size_t n)
+{
+	size_t len = 1;
+	for ( ; n >= 16; n /= 16)
+		len++;
+	return len;
+}
+
+/* Adds the chunk framing around the data, which the buffer has room for */
+static int
+chunked_sink(const char *data, size_t len, void *arg)
+{
+	struct chunked *c = (struct chunked*)arg;
+	(void)data;
+
+	char *p = c->data - hex_len(len) - 2; // 2 -> \r\n
+	char *end = c->data + len;
+	end[0] = '\r';
+	end[1] = '\n';
+	for (size_t n = len, i = hex_len(len); i; n /= 16)
+		p[--i] = "0123456789ABCDEF"[n % 16];
+	c->data[-2] = '\r';
+	c->data[-1] = '\n';
+
+	return c->write(p, (size_t)(end + 2 - p), c->arg);
+}
+
+size_t
+json_generate_chunked(char *buf, const struct to_json *tjs, size_t len,
+		int (*write)(const char *data, size_t len, void *arg),
+		void *arg)
+{
+	// 4 -> \r\n before and after the data
+	size_t framing = hex_len(len) + 4;
+	if (len <= framing)
+		return 0;
+
+	struct chunked c = { .data = buf + framing - 2, .write = write,
+		.arg = arg };
+	size_t l = json_generate_stream(c.data, tjs, len - framing,
+			chunked_sink, &c);
+	if (!l || write("0\r\n\r\n", 5, arg))
+		return 0;
+	return l;
+}
+
+size_t
+json_generate_delta(char *out, const struct to_json *tjs, size_t len,
+		unsigned since)
+{
+	truncate_mode = 0;
+	delta_mode = 1;
+	delta_since = since;
+	size_t l = generate(out, tjs, len);
+	delta_mode = 0;
+	return l;
+}
+
+size_t
+json_generate_truncated(char *out, const struct to_json *tjs, size_t len,
+		size_t *omitted)
+{
+	truncate_mode = 1;
+	size_t l = generate(out, tjs, len);
+	truncate_mode = 0;
+
+	if (omitted)
+		*omitted = omitted_elements;
+	return l;
+}
+
+size_t
+json_generate_prioritized(char *out, const struct to_json *tjs, size_t len,
+		size_t *omitted)
+{
+	if (omitted)
+		*omitted = 0;
+
+	if (tjs->stype != t_to_object || len < 3) // 3 -> {}\0
+		return json_generate(out, tjs, len);
+
+	truncate_mode = 0;
+	truncated = 0;
+	omitted_elements = 0;
+	size_t l = generate_prioritized(out, tjs, len);
+	if (omitted && l)
+		*omitted = omitted_elements;
+	return l;
+}
+
+/*
+ * Returns the number of documents needed for 'split_member' and sets
+ * 'split_budget'. Uses 'out' with 'len' bytes as scratch space.
+ */
+static unsigned
+plan_split(char *out, const struct to_json *tjs, size_t len,
+		struct json_split *split)
+{
+	/* Length of a document with an empty array, the document count can't be
+	 * larger than the element count */
+	split->index = split->total = (unsigned)*split_member->count;
+	split_first = *split_member->count;
+	size_t l = json_generate(out, tjs, len);
+	if (!l)
+		return 0;
+
+	split_budget = len - l - 1; // \0
+	return count_chunks(out, len);
+}
+
+unsigned
+json_generate_split(char *out, const struct to_json *tjs, size_t len,
+		struct json_split *split)
+{
+	split_member = NULL;
+	if (tjs->stype == t_to_object)
+		for (const struct to_json *m = tjs; m->name && !split_member;
+				m++)
+			if (m->count && c_array_incr(m->vtype))
+				split_member = m;
+
+	unsigned chunks = split_member ? plan_split(out, tjs, len, split) : 1;
+
+	split_next = 0;
+	for (split->index = 0; split->index < chunks; split->index++){
+		split->total = chunks;
+		split_first = split_next;
+		size_t l = json_generate(out, tjs, len);
+		if (!l || !enter_callback()){
+			chunks = 0;
+			break;
+		}
+		int ret = split->send(out, l, split->arg);
+		leave_callback();
+		if (ret){
+			chunks = 0;
+			break;
+		}
+	}
+
+	split_member = NULL;
+	return chunks;
+}
+
+static size_t
+varint_len(size_t n)
+{
+	size_t len = 1;
+	for ( ; n >= 0x80; n >>= 7)
+		len++;
+	return len;
+}
+
+static size_t
+frame_header_len(const struct json_frame *frame, size_t len)
+{
+	switch (frame->type) {
+	case json_frame_u16le:
+	case json_frame_u16be:
+		return 2;
+	case json_frame_u32le:
+	case json_frame_u32be:
+		return 4;
+	case json_frame_varint:
+		/* The text is shorter than the buffer */
+		return varint_len(len);
+	case json_frame_custom:
+		return frame->header_len;
+	}
+	return len;
+}
+
+/* Writes 'n' in 'len' bytes to 'out' */
+static void
+put_uint(char *out, size_t n, size_t len, _Bool big_endian)
+{
+	for (size_t i = 0; i < len; i++, n >>= 8)
+		out[big_endian ? len - 1 - i : i] = (char)(n & 0xFF);
+}
+
+/* Writes 'n' as varint to 'out', which ends at 'end' */
+static void
+put_varint(char *out, const char *end, size_t n)
+{
+	for ( ; out < end; out++, n >>= 7)
+		*out = (char)((n & 0x7F) | (out + 1 < end ? 0x80 : 0));
+}
+
+char*
+json_generate_framed(char *out, const struct to_json *tjs, size_t len,
+		const struct json_frame *frame, size_t *frame_len)
+{
+	size_t hlen = frame_header_len(frame, len);
+	if (len <= hlen)
+		return NULL;
+
+	char *body = out + hlen;
+	size_t l = json_generate(body, tjs, len - hlen);
+	if (!l)
+		return NULL;
+
+	switch (frame->type) {
+	case json_frame_u16le:
+	case json_frame_u16be:
+		if (l > 0xFFFF)
+			return NULL;
+		put_uint(out, l, hlen, frame->type == json_frame_u16be);
+		break;
+	case json_frame_u32le:
+	case json_frame_u32be:
+		if ((uint64_t)l > UINT32_MAX)
+			return NULL;
+		put_uint(out, l, hlen, frame->type == json_frame_u32be);
+		break;
+	case json_frame_varint:
+		out = body - varint_len(l);
+		put_varint(out, body, l);
+		break;
+	case json_frame_custom:
+		if (!enter_callback())
+			return NULL;
+		frame->fill(out, hlen, body, l, frame->arg);
+		leave_callback();
+		break;
+	}
+
+	*frame_len = (size_t)(body - out) + l;
+	return out;
+}
+
+/* Fingerprint of the memory referenced by a descriptor */
+STATE uint64_t fingerprint;
+
+static void
+fp_word(uint64_t v)
+{
+	uint64_t h = (fingerprint ^ v) * 0x9E3779B97F4A7C15;
+	fingerprint = h ^ (h >> 29);
+}
+
+/* Hashes 'len' bytes at 'p' a word at a time */
+static void
+fp_bytes(const void *p, size_t len)
+{
+	const unsigned char *s = (const unsigned char*)p;
+	fp_word(len);
+	for ( ; len >= 8; len -= 8, s += 8){
+		uint64_t v;
+		memcpy(&v, s, 8);
+		fp_word(v);
+	}
+	uint64_t v = 0;
+	memcpy(&v, s, len);
+	fp_word(v);
+}
+
+static void
+fp_string(const char *s)
+{
+	fp_bytes(s, strlen(s));
+}
+
+static void fp_value(enum json_to_type vtype, const void *val);
+
+static void
+fp_c_array(const struct to_json *tjs)
+{
+	size_t incr = c_array_incr(tjs->vtype);
+	fp_word(*tjs->count);
+	if (tjs->vtype != t_to_map && tjs->vtype != t_to_object){
+		fp_bytes(tjs->value, *tjs->count * incr);
+		return;
+	}
+
+	const char *p = tjs->value;
+	for (size_t i = 0; i < *tjs->count; i++)
+		fp_value(tjs->vtype, p + i * incr);
+}
+
+static void
+fp_primitive(const struct to_json *tjs)
+{
+	fp_word(tjs->vtype);
+	if (tjs->version)
+		fp_word(*tjs->version);
+	else if (tjs->count)
+		fp_c_array(tjs);
+	else
+		fp_value(tjs->vtype, tjs->value);
+}
+
+static void
+fp_map(const struct to_json_map *map)
+{
+	size_t incr = map_value_indirect(map->vtype) ? sizeof(const void*)
+		: c_array_incr(map->vtype);
+	const char *p = map->values;
+	fp_word(map->vtype);
+	fp_word(*map->count);
+	for (size_t i = 0; i < *map->count; i++, p += incr){
+		if (map->key_lens)
+			fp_bytes(map->keys[i], map->key_lens[i]);
+		else
+			fp_string(map->keys[i]);
+
+		if (map_value_indirect(map->vtype))
+			fp_value(map->vtype, *(const void * const*)p);
+		else
+			fp_bytes(p, incr);
+	}
+}
+
+/* Hashes the memory 'val' of type 'vtype' is generated from */
+static void
+fp_value(enum json_to_type vtype, const void *val)
+{
+	if (!val){
+		fp_word(0);
+		return;
+	}
+
+	const struct to_json *tjs = (const struct to_json*)val;
+	switch (vtype) {
+	case t_to_array:
+		for ( ; tjs->value; tjs++)
+			fp_primitive(tjs);
+		break;
+	case t_to_object:
+		for ( ; tjs->name; tjs++){
+			fp_string(tjs->name);
+			fp_primitive(tjs);
+		}
+		break;
+	case t_to_const: // Never changes
+		break;
+	case t_to_map:
+		fp_map(val);
+		break;
+	case t_to_primitive:
+		fp_primitive(tjs);
+		break;
+	case t_to_null:
+		break;
+	case t_to_string:
+	case t_to_value:
+		fp_string(val);
+		break;
+	default:
+		fp_bytes(val, c_array_incr(vtype));
+		break;
+	}
+}
+
+size_t
+json_generate_cached(char *out, const struct to_json *tjs, size_t len,
+		struct json_cache *cache)
+{
+	fingerprint = len;
+	fp_word(tjs->stype);
+	fp_value(tjs->stype, tjs);
+
+	if (cache->len && cache->out == out
+			&& cache->fingerprint == fingerprint){
+		cache->hits++;
+		return cache->len;
+	}
+
+	cache->misses++;
+	cache->out = out;
+	cache->fingerprint = fingerprint;
+	cache->len = json_generate(out, tjs, len);
+	return cache->len;
 }
@@ -7,6 +7,7 @@
 #define RKTA_MTOJSON_H
 
 #include <stddef.h>
+#include <stdint.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -16,6 +17,7 @@ enum json_to_type {
 	t_to_primitive,
 	t_to_array,
 	t_to_boolean,
+	t_to_const,
 	t_to_hex,
 	t_to_hex_u8,
 	t_to_hex_u16,
@@ -28,6 +30,7 @@ enum json_to_type {
 	t_to_int64_t,
 	t_to_long,
 	t_to_longlong,
+	t_to_map,
 	t_to_null,
 	t_to_object,
 	t_to_string,
@@ -47,11 +50,244 @@ struct to_json {
 	const size_t *count;     // Number of elements in a C array
 	enum json_to_type stype; // Type of the struct
 	enum json_to_type vtype; // Type of '.value'
+	unsigned char priority;  // See json_generate_prioritized()
+	const unsigned *version; // Optional, incremented when '.value' changes
+};
+
+/*
+ * A map is an object with keys known only at runtime. '.values' points to a
+ * C array of '*count' elements of type '.vtype', the n-th key is stored in
+ * 'keys[n]'. For strings, raw values and structured types '.values' is an
+ * array of pointers.
+ */
+struct to_json_map {
+	const char * const *keys;
+	const size_t *key_lens;  // Optional, strlen() is used if NULL
+	const void *values;
+	const size_t *count;     // Number of entries
+	enum json_to_type vtype; // Type of the values
+};
+
+/*
+ * A subtree whose JSON text never changes. It is generated into 'buf' at first
+ * use, or can be given as pre-generated text in '.text' and '.len', and is
+ * copied to the output afterwards. 'buf' must hold the text plus a NUL byte,
+ * otherwise the subtree is generated every time.
+ * Only 'buf' and '*buf_len' are written, so the struct itself may be const.
+ */
+struct to_json_const {
+	const struct to_json *tjs; // Subtree, '.stype' must be set
+	char *buf;
+	size_t size;               // Size of 'buf'
+	size_t *buf_len;           // Length of the text in 'buf', 0 at first
+	const char *text;          // Pre-generated text
+	size_t len;                // Length of '.text', 0 to use 'tjs'
 };
 
 /* Returns the length of the generated JSON text or 0 in case of an error. */
 size_t json_generate(char *out, const struct to_json *tjs, size_t len);
 
+/*
+ * Like json_generate(), but returns the length of the complete JSON text even
+ * if it does not fit into 'len' bytes, like snprintf(). If the return value
+ * is 'len' or more, 'out' holds the NUL terminated start of the text. 'out'
+ * may be NULL if 'len' is 0. Returns 0 in case of an error.
+ */
+size_t json_generate_size(char *out, const struct to_json *tjs, size_t len);
+
+/*
+ * Generates JSON text of any length using 'buf' of 'len' bytes as buffer.
+ * Whenever the buffer is full and at the end, its content is passed to
+ * 'sink'. A return value other than 0 from 'sink' aborts.
+ * The buffer must hold the longest number or member name and a byte for every
+ * level of nesting, strings are split.
+ * 'sink' may generate JSON text itself, nested up to MTOJSON_CALLBACK_DEPTH
+ * levels (1 by default), deeper calls of a callback fail.
+ * Returns the length of the JSON text or 0 in case of an error.
+ */
+size_t json_generate_stream(char *buf, const struct to_json *tjs, size_t len,
+		int (*sink)(const char *data, size_t len, void *arg),
+		void *arg);
+
+/*
+ * Generates the part of the JSON text starting at 'offset' into 'buf' of 'len'
+ * bytes, as much as fits. The text before 'offset' is generated again and
+ * discarded. Returns the length of the NUL terminated part, 0 at the end of
+ * the text or (size_t)-1 in case of an error, e.g. if a number does not fit
+ * into the buffer. The parts returned before are not a complete text then.
+ * The buffer must be large enough like for json_generate_stream().
+ */
+size_t json_generate_part(char *buf, const struct to_json *tjs, size_t len,
+		size_t offset);
+
+/* Levels a reader resumes directly, deeper levels are generated again */
+#define JSON_READER_DEPTH 16
+
+/* Position of a reader in the JSON text, see json_reader_next() */
+struct json_reader {
+	const struct to_json *tjs;
+	size_t offset;                    // Length of the text read so far
+	unsigned depth;                   // Levels of the saved path
+	size_t index[JSON_READER_DEPTH];  // Element on each level
+	size_t start[JSON_READER_DEPTH];  // Offset of the element
+};
+
+void json_reader_init(struct json_reader *r, const struct to_json *tjs);
+
+/*
+ * Generates the next part of the JSON text of the reader into 'buf' of 'len'
+ * bytes, like json_generate_part(). Generation resumes at the elements being
+ * generated when the previous part was full, so only the current element is
+ * generated again.
+ * Returns the length of the NUL terminated part, 0 at the end of the text or
+ * (size_t)-1 in case of an error.
+ */
+size_t json_reader_next(struct json_reader *r, char *buf, size_t len);
+
+enum json_digest_type {
+	json_digest_crc32c = 1,
+	json_digest_hash = 2,   // 64 bit FNV-1a
+};
+
+struct json_digest {
+	unsigned types;  // Digests to compute, set of enum json_digest_type
+	uint32_t crc32c;
+	uint64_t hash;
+};
+
+/*
+ * Like json_generate(), but computes the digests of the JSON text selected in
+ * '.types' of 'digest' while it is generated.
+ */
+size_t json_generate_digest(char *out, const struct to_json *tjs, size_t len,
+		struct json_digest *digest);
+
+/*
+ * Like json_generate_stream(), but computes the digests of the JSON text
+ * selected in '.types' of 'digest' over every chunk before it is passed to
+ * 'sink'.
+ */
+size_t json_generate_stream_digest(char *buf, const struct to_json *tjs,
+		size_t len,
+		int (*sink)(const char *data, size_t len, void *arg),
+		void *arg, struct json_digest *digest);
+
+/*
+ * Like json_generate_stream(), but passes the JSON text to 'write' in HTTP/1.1
+ * chunked transfer encoding, followed by the terminating chunk. Every chunk
+ * is passed in a single call and is, including its framing, at most 'len'
+ * bytes long.
+ */
+size_t json_generate_chunked(char *buf, const struct to_json *tjs, size_t len,
+		int (*write)(const char *data, size_t len, void *arg),
+		void *arg);
+
+/*
+ * Like json_generate(), but if the JSON text does not fit into 'len' bytes,
+ * trailing array elements and object members are dropped and all open
+ * containers are closed, so the result is still valid JSON. The number of
+ * dropped elements is stored in 'omitted' if not NULL.
+ * Returns 0 if not even the outermost value fits.
+ */
+size_t json_generate_truncated(char *out, const struct to_json *tjs, size_t len,
+		size_t *omitted);
+
+/*
+ * Like json_generate(), but if an object does not fit into 'len' bytes, its
+ * members are included by '.priority' instead of failing: all members of the
+ * most important levels which fit completely, and of the next level as many
+ * as still fit. Members with priority 0 are mandatory. The order of the
+ * members is kept. The number of dropped members is stored in 'omitted' if
+ * not NULL.
+ * Only the members of the outermost object are considered, nested values are
+ * kept or dropped as a whole.
+ */
+size_t json_generate_prioritized(char *out, const struct to_json *tjs,
+		size_t len, size_t *omitted);
+
+/*
+ * Like json_generate(), but only members of objects whose '.version' is newer
+ * than 'since' are generated. Members without '.version' are left out, unless
+ * they are objects which contain newer members; those are generated with only
+ * the newer members. A member with '.version' is always generated completely.
+ * The version counters are usually set from a global counter which is
+ * incremented on every change, 'since' is its value at the last call.
+ */
+size_t json_generate_delta(char *out, const struct to_json *tjs, size_t len,
+		unsigned since);
+
+enum json_frame_type {
+	json_frame_u16le,
+	json_frame_u16be,
+	json_frame_u32le,
+	json_frame_u32be,
+	json_frame_varint, // Unsigned LEB128
+	json_frame_custom,
+};
+
+struct json_frame {
+	enum json_frame_type type;
+	/* Only used for json_frame_custom */
+	size_t header_len;
+	void (*fill)(char *header, size_t header_len, const char *body,
+			size_t len, void *arg);
+	void *arg;       // Passed to fill()
+};
+
+/*
+ * Generates a frame of a header and the JSON text into 'out'. The header holds
+ * the length of the text in the format given by '.type', or is filled by
+ * '.fill' for json_frame_custom, which may generate JSON text itself like the
+ * sink of json_generate_stream().
+ * Returns the start of the frame and stores its length in 'frame_len', or
+ * returns NULL in case of an error. The frame starts at 'out', except for
+ * varint headers, which are shorter than the space reserved for them if the
+ * text is short.
+ */
+char *json_generate_framed(char *out, const struct to_json *tjs, size_t len,
+		const struct json_frame *frame, size_t *frame_len);
+
+struct json_split {
+	unsigned index;  // Index of the document being generated
+	unsigned total;  // Number of documents
+	int (*send)(const char *json, size_t len, void *arg);
+	void *arg;       // Passed to send()
+};
+
+/*
+ * Generates the object 'tjs' as a sequence of documents of at most 'len' bytes
+ * each. The first member which is a C array is split into chunks, all other
+ * members are repeated in every document.
+ * '.index' and '.total' of 'split' are updated before each document is
+ * generated, so they can be used as members of 'tjs'. '.send' is called with
+ * every document, a return value other than 0 aborts. Chunk boundaries are
+ * calculated from the measured length of the elements. Like the sink of
+ * json_generate_stream(), '.send' may generate JSON text itself.
+ * Returns the number of documents or 0 in case of an error.
+ */
+unsigned json_generate_split(char *out, const struct to_json *tjs, size_t len,
+		struct json_split *split);
+
+struct json_cache {
+	const char *out;       // Buffer holding the cached JSON text
+	size_t len;            // Length of the cached JSON text, 0 if none
+	uint64_t fingerprint;  // Hash of the memory the text was generated from
+	unsigned long hits;
+	unsigned long misses;
+};
+
+/*
+ * Like json_generate(), but the JSON text is only generated if the memory
+ * referenced by 'tjs' changed since the last call with 'cache' or if 'out' or
+ * 'len' differ. Otherwise the text in 'out' is kept and its length returned.
+ * Changes are detected by a 64 bit hash over the names, values, counts and
+ * types in the descriptor. For values with a '.version' only the version is
+ * hashed, so their changes are only detected if it is incremented.
+ * '.hits' and '.misses' count the calls. Initialize 'cache' with zeros.
+ */
+size_t json_generate_cached(char *out, const struct to_json *tjs, size_t len,
+		struct json_cache *cache);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,1226 @@
+/*
+   SPDX-License-Identifier: BSD-2-Clause
+   This file is Copyright (c) 2020, 2021 by Rene Kita
+*/
+
+#ifndef RKTA_MTOJSON_HPP
+#define RKTA_MTOJSON_HPP
+
+#include "mtojson.h"
+
+#include <array>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <algorithm>
+#include <cstring>
+#include <exception>
+#include <iterator>
+#include <limits>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+/*
+ * C++ helpers which build 'struct to_json' descriptors with the value type
+ * and the count of C arrays deduced from the referenced variables:
+ *
+ *	int n;
+ *	int arr[4];
+ *	const auto tjs = json::object(json::field("n", n), json::field("arr", arr));
+ *	json::generate(out, tjs);
+ *
+ * The descriptors only reference the variables, which must outlive them.
+ */
+namespace json {
+
+namespace detail {
+
+/* Value type of 'T', unsupported types don't compile */
+template<typename T> struct vtype;
+
+template<enum json_to_type V>
+struct vtype_is : std::integral_constant<enum json_to_type, V> {};
+
+static_assert(sizeof(bool) == 1, "bool must match _Bool");
+static_assert(std::is_same<std::int8_t, signed char>::value
+		&& std::is_same<std::int16_t, short>::value
+		&& std::is_same<std::uint8_t, unsigned char>::value
+		&& std::is_same<std::uint16_t, unsigned short>::value,
+		"unsupported integer types");
+
+template<> struct vtype<bool> : vtype_is<t_to_boolean> {};
+template<> struct vtype<signed char> : vtype_is<t_to_int8_t> {};
+template<> struct vtype<short> : vtype_is<t_to_int16_t> {};
+template<> struct vtype<int> : vtype_is<t_to_int> {};
+template<> struct vtype<long> : vtype_is<t_to_long> {};
+template<> struct vtype<long long> : vtype_is<t_to_longlong> {};
+template<> struct vtype<unsigned char> : vtype_is<t_to_uint8_t> {};
+template<> struct vtype<unsigned short> : vtype_is<t_to_uint16_t> {};
+template<> struct vtype<unsigned> : vtype_is<t_to_uint> {};
+template<> struct vtype<unsigned long> : vtype_is<t_to_ulong> {};
+template<> struct vtype<unsigned long long> : vtype_is<t_to_ulonglong> {};
+template<> struct vtype<std::nullptr_t> : vtype_is<t_to_null> {};
+template<> struct vtype<struct to_json_map> : vtype_is<t_to_map> {};
+template<> struct vtype<struct to_json_const> : vtype_is<t_to_const> {};
+
+/* Storage for the count of C arrays with a size known at compile time */
+template<std::size_t N>
+inline constexpr std::size_t count = N;
+
+template<typename T>
+constexpr struct to_json
+scalar(const char *name, const T &val)
+{
+	return { name, &val, nullptr, t_to_primitive, vtype<T>::value, 0, nullptr };
+}
+
+template<typename T, std::size_t N>
+constexpr struct to_json
+c_array(const char *name, const T *val)
+{
+	static_assert(!std::is_same<T, char>::value, "use a string");
+	return { name, val, &count<N>, t_to_primitive, vtype<T>::value, 0, nullptr };
+}
+
+constexpr struct to_json
+string(const char *name, const char *val)
+{
+	return { name, val, nullptr, t_to_primitive, t_to_string, 0, nullptr };
+}
+
+template<std::size_t N>
+constexpr struct to_json
+nested(const char *name, const std::array<struct to_json, N> &val)
+{
+	return { name, val.data(), nullptr, t_to_primitive, val[0].stype, 0, nullptr };
+}
+
+} // namespace detail
+
+/* Describes the member 'name' of an object, or an array element if NULL */
+template<typename T>
+constexpr struct to_json
+field(const char *name, const T &val)
+{
+	return detail::scalar(name, val);
+}
+
+template<typename T, std::size_t N>
+constexpr struct to_json
+field(const char *name, const T (&val)[N])
+{
+	return detail::c_array<T, N>(name, val);
+}
+
+template<std::size_t N>
+constexpr struct to_json
+field(const char *name, const char (&val)[N])
+{
+	return detail::string(name, val);
+}
+
+constexpr struct to_json
+field(const char *name, const char * const &val)
+{
+	return detail::string(name, val);
+}
+
+constexpr struct to_json
+field(const char *name, char * const &val)
+{
+	return detail::string(name, val);
+}
+
+template<typename T, std::size_t N>
+constexpr struct to_json
+field(const char *name, const std::array<T, N> &val)
+{
+	return detail::c_array<T, N>(name, val.data());
+}
+
+/* Objects and arrays built by object() and array() */
+template<std::size_t N>
+constexpr struct to_json
+field(const char *name, const std::array<struct to_json, N> &val)
+{
+	return detail::nested(name, val);
+}
+
+/* The descriptor would point to a temporary */
+template<typename T>
+struct to_json field(const char *name, const T &&val) = delete;
+
+/* Describes an array element or a single primitive value */
+template<typename T>
+constexpr struct to_json
+value(const T &val)
+{
+	return field(nullptr, val);
+}
+
+template<typename T>
+struct to_json value(const T &&val) = delete;
+
+/* Returns the NULL terminated descriptor of an object with 'members' */
+template<typename... M>
+constexpr std::array<struct to_json, sizeof...(M) + 1>
+object(const M &...members)
+{
+	std::array<struct to_json, sizeof...(M) + 1> tjs{ { members..., {} } };
+	tjs[0].stype = t_to_object;
+	return tjs;
+}
+
+/* Returns the NULL terminated descriptor of an array with 'elements' */
+template<typename... E>
+constexpr std::array<struct to_json, sizeof...(E) + 1>
+array(const E &...elements)
+{
+	std::array<struct to_json, sizeof...(E) + 1> tjs{ { elements..., {} } };
+	tjs[0].stype = t_to_array;
+	return tjs;
+}
+
+/* Returns the descriptor of a single primitive value */
+template<typename T>
+constexpr std::array<struct to_json, 1>
+primitive(const T &val)
+{
+	return { { value(val) } };
+}
+
+template<typename T>
+std::array<struct to_json, 1> primitive(const T &&val) = delete;
+
+/* Like json_generate() with the length of the buffer deduced */
+template<std::size_t L, std::size_t N>
+std::size_t
+generate(char (&out)[L], const std::array<struct to_json, N> &tjs)
+{
+	return json_generate(out, tjs.data(), L);
+}
+
+template<std::size_t L, std::size_t N>
+std::size_t
+generate(std::array<char, L> &out, const std::array<struct to_json, N> &tjs)
+{
+	return json_generate(out.data(), tjs.data(), L);
+}
+
+/*
+ * Objects with a shape fixed at compile time. The keys are template arguments,
+ * the quoted keys including the separators are built at compile time and the
+ * values are formatted without walking a descriptor:
+ *
+ *	const auto doc = json::static_object(json::key<"n">(n), json::key<"arr">(arr));
+ *	json::buffer<decltype(doc)> out;
+ *	json::serialize(out, doc);
+ *
+ * json::max_size<D> is the maximum length of the JSON text of 'D', so the
+ * buffer can't be too small. Supported values are bool, integers, char arrays
+ * as strings, C arrays and std::array of supported values and nested objects.
+ */
+
+namespace detail {
+
+template<std::size_t N>
+struct fixed_string {
+	char s[N];
+
+	constexpr fixed_string(const char (&str)[N])
+	{
+		for (std::size_t i = 0; i < N; i++)
+			s[i] = str[i];
+	}
+};
+
+/* Length of the quoted and escaped key */
+constexpr std::size_t
+quoted_len(const char *key)
+{
+	std::size_t len = 2;
+	for (const char *p = key; *p; p++)
+		len += *p == '"' || *p == '\\' ? 2 : 1;
+	return len;
+}
+
+/* The separator in front of the member, the quoted key and ':' */
+template<std::size_t L>
+constexpr std::array<char, L>
+make_fragment(const char *key, bool first)
+{
+	std::array<char, L> f{};
+	std::size_t i = 0;
+	f[i++] = first ? '{' : ',';
+	f[i++] = '"';
+	for (const char *p = key; *p; p++){
+		if (*p == '"' || *p == '\\')
+			f[i++] = '\\';
+		f[i++] = *p;
+	}
+	f[i++] = '"';
+	f[i++] = ':';
+	return f;
+}
+
+template<fixed_string K, bool First>
+inline constexpr auto fragment = make_fragment<quoted_len(K.s) + 2>(K.s, First);
+
+template<std::size_t N>
+char*
+copy(char *out, const std::array<char, N> &f)
+{
+	std::memcpy(out, f.data(), N);
+	return out + N;
+}
+
+} // namespace detail
+
+template<detail::fixed_string K, typename T, bool First = false>
+struct member;
+
+/* Object built by static_object() */
+template<typename... M>
+struct fixed_object {
+	std::tuple<M...> members;
+};
+
+/*
+ * Names of the fields of the aggregate 'T', set by MTOJSON_NAMES(T, ...).
+ * Aggregates with names are serialized as objects, without as arrays.
+ */
+template<typename T>
+struct field_names;
+
+namespace detail {
+
+template<typename T>
+concept named = requires { field_names<T>::names; };
+
+/* Converts to every field type, used to count the fields of an aggregate */
+struct any_field {
+	template<typename U>
+	operator U() const;
+};
+
+template<typename T, typename... A>
+consteval std::size_t
+count_fields()
+{
+	if constexpr (requires { T{ A{}..., any_field{} }; })
+		return count_fields<T, A..., any_field>();
+	else
+		return sizeof...(A);
+}
+
+/*
+ * Number of fields of 'T'. Counting without names fails for fields which are
+ * C arrays, their elements are counted.
+ */
+template<typename T>
+consteval std::size_t
+field_count()
+{
+	if constexpr (named<T>)
+		return std::size(field_names<T>::names);
+	else
+		return count_fields<T>();
+}
+
+/* Returns a tuple of references to the fields of 'val' */
+template<std::size_t N, typename T>
+constexpr auto
+tie_fields(const T &val)
+{
+	if constexpr (N == 1){
+		const auto &[a] = val;
+		return std::tie(a);
+	}
+	else if constexpr (N == 2){
+		const auto &[a, b] = val;
+		return std::tie(a, b);
+	}
+	else if constexpr (N == 3){
+		const auto &[a, b, c] = val;
+		return std::tie(a, b, c);
+	}
+	else if constexpr (N == 4){
+		const auto &[a, b, c, d] = val;
+		return std::tie(a, b, c, d);
+	}
+	else if constexpr (N == 5){
+		const auto &[a, b, c, d, e] = val;
+		return std::tie(a, b, c, d, e);
+	}
+	else if constexpr (N == 6){
+		const auto &[a, b, c, d, e, f] = val;
+		return std::tie(a, b, c, d, e, f);
+	}
+	else if constexpr (N == 7){
+		const auto &[a, b, c, d, e, f, g] = val;
+		return std::tie(a, b, c, d, e, f, g);
+	}
+	else if constexpr (N == 8){
+		const auto &[a, b, c, d, e, f, g, h] = val;
+		return std::tie(a, b, c, d, e, f, g, h);
+	}
+	else if constexpr (N == 9){
+		const auto &[a, b, c, d, e, f, g, h, i] = val;
+		return std::tie(a, b, c, d, e, f, g, h, i);
+	}
+	else if constexpr (N == 10){
+		const auto &[a, b, c, d, e, f, g, h, i, j] = val;
+		return std::tie(a, b, c, d, e, f, g, h, i, j);
+	}
+	else if constexpr (N == 11){
+		const auto &[a, b, c, d, e, f, g, h, i, j, k] = val;
+		return std::tie(a, b, c, d, e, f, g, h, i, j, k);
+	}
+	else if constexpr (N == 12){
+		const auto &[a, b, c, d, e, f, g, h, i, j, k, l] = val;
+		return std::tie(a, b, c, d, e, f, g, h, i, j, k, l);
+	}
+	else if constexpr (N == 13){
+		const auto &[a, b, c, d, e, f, g, h, i, j, k, l, m] = val;
+		return std::tie(a, b, c, d, e, f, g, h, i, j, k, l, m);
+	}
+	else if constexpr (N == 14){
+		const auto &[a, b, c, d, e, f, g, h, i, j, k, l, m, n] = val;
+		return std::tie(a, b, c, d, e, f, g, h, i, j, k, l, m, n);
+	}
+	else if constexpr (N == 15){
+		const auto &[a, b, c, d, e, f, g, h, i, j, k, l, m, n, o] = val;
+		return std::tie(a, b, c, d, e, f, g, h, i, j, k, l, m, n, o);
+	}
+	else if constexpr (N == 16){
+		const auto &[a, b, c, d, e, f, g, h, i, j, k, l, m, n, o, p] = val;
+		return std::tie(a, b, c, d, e, f, g, h, i, j, k, l, m, n, o, p);
+	}
+	else
+		static_assert(N <= 16, "too many fields");
+}
+
+template<typename T>
+struct is_std_array : std::false_type {};
+
+template<typename T, std::size_t N>
+struct is_std_array<std::array<T, N>> : std::true_type {};
+
+template<typename T>
+struct is_fixed_object;
+
+template<typename T>
+concept reflectable = std::is_class_v<T> && std::is_aggregate_v<T>
+	&& !is_std_array<T>::value && !is_fixed_object<T>::value
+	&& field_count<T>() > 0 && field_count<T>() <= 16;
+
+template<typename T>
+using fields_of = decltype(tie_fields<field_count<T>()>(std::declval<const T&>()));
+
+template<typename T, std::size_t I>
+inline constexpr auto name_fragment = make_fragment<quoted_len(field_names<T>::names[I]) + 2>(
+		field_names<T>::names[I], I == 0);
+
+template<typename T>
+consteval std::size_t
+names_len()
+{
+	return [] <std::size_t... I> (std::index_sequence<I...>) {
+		return (0 + ... + name_fragment<T, I>.size());
+	}(std::make_index_sequence<field_count<T>()>{});
+}
+
+} // namespace detail
+
+namespace detail {
+
+template<typename T>
+struct is_fixed_object : std::false_type {};
+
+template<typename... M>
+struct is_fixed_object<fixed_object<M...>> : std::true_type {};
+
+/* Maximum length of the JSON text of 'T', not defined for unbounded types */
+template<typename T, typename = void>
+struct bound {};
+
+template<>
+struct bound<bool> : std::integral_constant<std::size_t, 5> {};
+
+template<typename T>
+struct bound<T, std::enable_if_t<std::is_integral_v<T> && !std::is_same_v<T, bool>
+		&& !std::is_same_v<T, char>>>
+	: std::integral_constant<std::size_t,
+		std::numeric_limits<T>::digits10 + 1 + std::is_signed_v<T>> {};
+
+/* Every character might be escaped */
+template<std::size_t N>
+struct bound<char[N]> : std::integral_constant<std::size_t, 2 + 2 * (N - 1)> {};
+
+template<typename T, std::size_t N>
+struct bound<T[N], std::enable_if_t<!std::is_same_v<T, char>,
+		std::void_t<decltype(bound<T>::value)>>>
+	: std::integral_constant<std::size_t, 2 + N * bound<T>::value + (N ? N - 1 : 0)> {};
+
+template<typename T, std::size_t N>
+struct bound<std::array<T, N>, std::void_t<decltype(bound<T[N]>::value)>>
+	: bound<T[N]> {};
+
+template<typename T, std::size_t N>
+	requires (N != std::dynamic_extent) && requires { bound<std::remove_cv_t<T>[N]>::value; }
+struct bound<std::span<T, N>> : bound<std::remove_cv_t<T>[N]> {};
+
+template<typename T>
+struct bound<std::optional<T>, std::void_t<decltype(bound<T>::value)>>
+	: std::integral_constant<std::size_t, bound<T>::value < 4 ? 4 : bound<T>::value> {};
+
+/* The first fragment holds '{' instead of ',' */
+template<typename... M>
+struct bound<fixed_object<M...>, std::void_t<decltype(bound<typename M::type>::value)...>>
+	: std::integral_constant<std::size_t, (sizeof...(M) ? 1 : 2)
+		+ (0 + ... + (M::fragment_len + bound<typename M::type>::value))> {};
+
+template<typename F, typename = void>
+struct fields_bound {};
+
+template<typename... F>
+struct fields_bound<std::tuple<const F&...>, std::void_t<decltype(bound<F>::value)...>>
+	: std::integral_constant<std::size_t, (0 + ... + bound<F>::value)> {};
+
+template<typename T, std::size_t L = fields_bound<fields_of<T>>::value>
+	requires reflectable<T>
+consteval std::size_t
+reflected_bound()
+{
+	if constexpr (named<T>)
+		return L + names_len<T>() + 1; // }
+	else
+		return L + field_count<T>() + 1; // [ ] and commas
+}
+
+template<typename T>
+	requires reflectable<T> && requires { fields_bound<fields_of<T>>::value; }
+struct bound<T> : std::integral_constant<std::size_t, reflected_bound<T>()> {};
+
+template<typename T>
+concept bounded = requires { bound<std::remove_cvref_t<T>>::value; };
+
+template<typename T>
+concept integer = std::is_integral_v<T> && !std::is_same_v<T, bool>
+	&& !std::is_same_v<T, char>;
+
+/* Maps with string keys are objects */
+template<typename T>
+concept map_like = requires {
+	typename T::key_type;
+	typename T::mapped_type;
+} && std::is_convertible_v<const typename T::key_type&, std::string_view>;
+
+/*
+ * write_value() writes the JSON text of a value and returns its end,
+ * size_value() returns its exact length. All overloads are declared first,
+ * because they call each other for nested values.
+ */
+inline char* write_value(char *out, bool val);
+template<integer T> char* write_value(char *out, T val);
+template<std::size_t N> char* write_value(char *out, const char (&val)[N]);
+inline char* write_value(char *out, const char *val);
+inline char* write_value(char *out, std::string_view val);
+inline char* write_value(char *out, const std::string &val);
+template<typename T> char* write_value(char *out, const std::optional<T> &val);
+template<typename T, std::size_t N>
+	requires (!std::is_same_v<T, char>)
+char* write_value(char *out, const T (&val)[N]);
+template<typename T, std::size_t N> char* write_value(char *out, const std::array<T, N> &val);
+template<typename T, std::size_t E> char* write_value(char *out, std::span<T, E> val);
+template<typename T, typename A> char* write_value(char *out, const std::vector<T, A> &val);
+template<map_like T> char* write_value(char *out, const T &val);
+template<typename... M> char* write_value(char *out, const fixed_object<M...> &val);
+template<reflectable T> char* write_value(char *out, const T &val);
+
+inline std::size_t size_value(bool val);
+template<integer T> std::size_t size_value(T val);
+template<std::size_t N> std::size_t size_value(const char (&val)[N]);
+inline std::size_t size_value(const char *val);
+inline std::size_t size_value(std::string_view val);
+inline std::size_t size_value(const std::string &val);
+template<typename T> std::size_t size_value(const std::optional<T> &val);
+template<typename T, std::size_t N>
+	requires (!std::is_same_v<T, char>)
+std::size_t size_value(const T (&val)[N]);
+template<typename T, std::size_t N> std::size_t size_value(const std::array<T, N> &val);
+template<typename T, std::size_t E> std::size_t size_value(std::span<T, E> val);
+template<typename T, typename A> std::size_t size_value(const std::vector<T, A> &val);
+template<map_like T> std::size_t size_value(const T &val);
+template<typename... M> std::size_t size_value(const fixed_object<M...> &val);
+template<reflectable T> std::size_t size_value(const T &val);
+
+inline char*
+write_value(char *out, bool val)
+{
+	if (val){
+		std::memcpy(out, "true", 4);
+		return out + 4;
+	}
+	std::memcpy(out, "false", 5);
+	return out + 5;
+}
+
+inline std::size_t
+size_value(bool val)
+{
+	return val ? 4 : 5;
+}
+
+template<integer T>
+constexpr std::make_unsigned_t<T>
+magnitude(T val)
+{
+	using U = std::make_unsigned_t<T>;
+	return val < 0 ? static_cast<U>(0 - static_cast<U>(val)) : static_cast<U>(val);
+}
+
+template<integer T>
+char*
+write_value(char *out, T val)
+{
+	using U = std::make_unsigned_t<T>;
+	U n = magnitude(val);
+	if (val < 0)
+		*out++ = '-';
+
+	char tmp[std::numeric_limits<U>::digits10 + 1];
+	char *end = tmp + sizeof(tmp);
+	char *s = end;
+	do
+		*--s = static_cast<char>('0' + n % 10);
+	while (n /= 10);
+	std::memcpy(out, s, static_cast<std::size_t>(end - s));
+	return out + (end - s);
+}
+
+template<integer T>
+std::size_t
+size_value(T val)
+{
+	std::size_t len = val < 0 ? 2 : 1;
+	for (auto n = magnitude(val); n >= 10; n /= 10)
+		len++;
+	return len;
+}
+
+inline char*
+write_string(char *out, const char *val, std::size_t len)
+{
+	*out++ = '"';
+	for (const char *end = val + len; val < end; val++){
+		if (*val == '"' || *val == '\\')
+			*out++ = '\\';
+		*out++ = *val;
+	}
+	*out++ = '"';
+	return out;
+}
+
+inline std::size_t
+size_string(const char *val, std::size_t len)
+{
+	std::size_t size = len + 2;
+	for (const char *end = val + len; val < end; val++)
+		size += *val == '"' || *val == '\\';
+	return size;
+}
+
+/* A char array is a string of at most N - 1 characters */
+template<std::size_t N>
+constexpr std::size_t
+array_strlen(const char (&val)[N])
+{
+	std::size_t len = 0;
+	while (len < N - 1 && val[len])
+		len++;
+	return len;
+}
+
+template<std::size_t N>
+char*
+write_value(char *out, const char (&val)[N])
+{
+	return write_string(out, val, array_strlen(val));
+}
+
+template<std::size_t N>
+std::size_t
+size_value(const char (&val)[N])
+{
+	return size_string(val, array_strlen(val));
+}
+
+inline char*
+write_value(char *out, std::string_view val)
+{
+	return write_string(out, val.data(), val.size());
+}
+
+inline std::size_t
+size_value(std::string_view val)
+{
+	return size_string(val.data(), val.size());
+}
+
+/* A null pointer is written as null, like json_generate() does */
+inline char*
+write_value(char *out, const char *val)
+{
+	if (val)
+		return write_value(out, std::string_view(val));
+	std::memcpy(out, "null", 4);
+	return out + 4;
+}
+
+inline std::size_t
+size_value(const char *val)
+{
+	return val ? size_value(std::string_view(val)) : 4;
+}
+
+inline char*
+write_value(char *out, const std::string &val)
+{
+	return write_value(out, std::string_view(val));
+}
+
+inline std::size_t
+size_value(const std::string &val)
+{
+	return size_value(std::string_view(val));
+}
+
+template<typename T>
+char*
+write_value(char *out, const std::optional<T> &val)
+{
+	if (val)
+		return write_value(out, *val);
+	std::memcpy(out, "null", 4);
+	return out + 4;
+}
+
+template<typename T>
+std::size_t
+size_value(const std::optional<T> &val)
+{
+	return val ? size_value(*val) : 4;
+}
+
+/* Arrays are written by a loop over the elements of the container */
+template<typename R>
+char*
+write_elements(char *out, const R &val)
+{
+	*out++ = '[';
+	bool first = true;
+	for (const auto &v : val){
+		if (!first)
+			*out++ = ',';
+		first = false;
+		out = write_value(out, v);
+	}
+	*out++ = ']';
+	return out;
+}
+
+template<typename R>
+std::size_t
+size_elements(const R &val)
+{
+	std::size_t len = 1;
+	for (const auto &v : val)
+		len += size_value(v) + 1;
+	return len + (len == 1);
+}
+
+template<typename T, std::size_t N>
+	requires (!std::is_same_v<T, char>)
+char*
+write_value(char *out, const T (&val)[N])
+{
+	return write_elements(out, val);
+}
+
+template<typename T, std::size_t N>
+	requires (!std::is_same_v<T, char>)
+std::size_t
+size_value(const T (&val)[N])
+{
+	return size_elements(val);
+}
+
+template<typename T, std::size_t N>
+char*
+write_value(char *out, const std::array<T, N> &val)
+{
+	return write_elements(out, val);
+}
+
+template<typename T, std::size_t N>
+std::size_t
+size_value(const std::array<T, N> &val)
+{
+	return size_elements(val);
+}
+
+template<typename T, std::size_t E>
+char*
+write_value(char *out, std::span<T, E> val)
+{
+	return write_elements(out, val);
+}
+
+template<typename T, std::size_t E>
+std::size_t
+size_value(std::span<T, E> val)
+{
+	return size_elements(val);
+}
+
+template<typename T, typename A>
+char*
+write_value(char *out, const std::vector<T, A> &val)
+{
+	return write_elements(out, val);
+}
+
+template<typename T, typename A>
+std::size_t
+size_value(const std::vector<T, A> &val)
+{
+	return size_elements(val);
+}
+
+template<map_like T>
+char*
+write_value(char *out, const T &val)
+{
+	*out++ = '{';
+	bool first = true;
+	for (const auto &[k, v] : val){
+		if (!first)
+			*out++ = ',';
+		first = false;
+		out = write_value(out, std::string_view(k));
+		*out++ = ':';
+		out = write_value(out, v);
+	}
+	*out++ = '}';
+	return out;
+}
+
+template<map_like T>
+std::size_t
+size_value(const T &val)
+{
+	std::size_t len = 1;
+	for (const auto &[k, v] : val)
+		len += size_value(std::string_view(k)) + size_value(v) + 2; // : and , or }
+	return len + (len == 1);
+}
+
+template<typename... M>
+char*
+write_value(char *out, const fixed_object<M...> &val)
+{
+	if constexpr (sizeof...(M) == 0)
+		*out++ = '{';
+	std::apply([&out](const M &...m){ ((out = m.write(out)), ...); }, val.members);
+	*out++ = '}';
+	return out;
+}
+
+template<typename... M>
+std::size_t
+size_value(const fixed_object<M...> &val)
+{
+	return std::apply([](const M &...m){
+		return (sizeof...(M) ? 1 : 2) + (0 + ... + (M::fragment_len + size_value(m.value)));
+	}, val.members);
+}
+
+template<reflectable T>
+char*
+write_value(char *out, const T &val)
+{
+	const auto fields = tie_fields<field_count<T>()>(val);
+	[&] <std::size_t... I> (std::index_sequence<I...>) {
+		if constexpr (named<T>){
+			((out = copy(out, name_fragment<T, I>),
+			  out = write_value(out, std::get<I>(fields))), ...);
+			*out++ = '}';
+		} else {
+			*out++ = '[';
+			((out = I ? (*out = ',', out + 1) : out,
+			  out = write_value(out, std::get<I>(fields))), ...);
+			*out++ = ']';
+		}
+	}(std::make_index_sequence<field_count<T>()>{});
+	return out;
+}
+
+template<reflectable T>
+std::size_t
+size_value(const T &val)
+{
+	const auto fields = tie_fields<field_count<T>()>(val);
+	return [&] <std::size_t... I> (std::index_sequence<I...>) {
+		std::size_t len = (0 + ... + size_value(std::get<I>(fields)));
+		if constexpr (named<T>)
+			return len + names_len<T>() + 1;
+		else
+			return len + field_count<T>() + 1;
+	}(std::make_index_sequence<field_count<T>()>{});
+}
+
+} // namespace detail
+
+namespace detail {
+
+template<typename T>
+struct is_span : std::false_type {};
+
+template<typename T, std::size_t E>
+struct is_span<std::span<T, E>> : std::true_type {};
+
+template<typename T>
+inline constexpr bool by_value = is_fixed_object<T>::value || is_span<T>::value
+	|| std::is_same_v<T, std::string_view>;
+
+} // namespace detail
+
+/* Member 'K' of a static object */
+template<detail::fixed_string K, typename T, bool First>
+struct member {
+	using type = T;
+
+	/* Nested objects and views only hold references and are stored as a copy */
+	std::conditional_t<detail::by_value<T>, T, const T&> value;
+
+	static constexpr std::size_t fragment_len = detail::fragment<K, false>.size();
+
+	constexpr member<K, T, true>
+	first() const
+	{
+		return { value };
+	}
+
+	char*
+	write(char *out) const
+	{
+		out = detail::copy(out, detail::fragment<K, First>);
+		return detail::write_value(out, value);
+	}
+};
+
+template<detail::fixed_string K, typename T>
+constexpr member<K, T>
+key(const T &val)
+{
+	return { val };
+}
+
+/* The member would reference a temporary */
+template<detail::fixed_string K, typename T>
+	requires (!detail::by_value<T>)
+member<K, T> key(const T &&val) = delete;
+
+/* Returns an object of the members built by key() */
+constexpr fixed_object<>
+static_object()
+{
+	return {};
+}
+
+template<typename F, typename... M>
+constexpr auto
+static_object(const F &first, const M &...m)
+{
+	return fixed_object<decltype(first.first()), M...>{ { first.first(), m... } };
+}
+
+/* Maximum length of the JSON text of 'D' without the terminating NUL */
+template<typename D>
+	requires detail::bounded<D>
+inline constexpr std::size_t max_size = detail::bound<std::remove_cvref_t<D>>::value;
+
+/* A buffer which holds every JSON text of 'D' */
+template<typename D>
+using buffer = std::array<char, max_size<D> + 1>;
+
+/* Writes the JSON text of 'doc' to 'out' and returns its end, no NUL is added */
+template<typename D>
+char*
+write(char *out, const D &doc)
+{
+	return detail::write_value(out, doc);
+}
+
+/* Writes the NUL terminated JSON text of 'doc' and returns its length */
+template<std::size_t L, typename D>
+	requires detail::bounded<D>
+std::size_t
+serialize(std::array<char, L> &out, const D &doc)
+{
+	static_assert(L > max_size<D>, "buffer too small");
+	char *end = write(out.data(), doc);
+	*end = '\0';
+	return static_cast<std::size_t>(end - out.data());
+}
+
+/* Returns the length of the JSON text of 'doc' */
+template<typename D>
+std::size_t
+size(const D &doc)
+{
+	return detail::size_value(doc);
+}
+
+/*
+ * Writes the NUL terminated JSON text of 'doc' to 'out' of 'len' bytes and
+ * returns its length, or 0 if it does not fit. The length is measured first
+ * unless it is bounded by the buffer.
+ */
+template<typename D>
+std::size_t
+serialize(char *out, std::size_t len, const D &doc)
+{
+	bool fits = false;
+	if constexpr (detail::bounded<D>)
+		fits = len > max_size<D>;
+	if (!fits && size(doc) >= len)
+		return 0;
+
+	char *end = write(out, doc);
+	*end = '\0';
+	return static_cast<std::size_t>(end - out);
+}
+
+/*
+ * Appends the JSON text of 'doc' to 'c', a std::string or std::vector<char>,
+ * and returns its length. The container is resized once to the measured
+ * length and the text is written in place.
+ */
+template<typename C, typename D>
+	requires std::is_same_v<typename C::value_type, char>
+		&& requires (C &c) { c.data(); c.resize(0); }
+std::size_t
+append(C &c, const D &doc)
+{
+	std::size_t len = size(doc);
+	std::size_t old = c.size();
+#if __cpp_lib_string_resize_and_overwrite
+	/* Avoids initializing the new characters */
+	if constexpr (std::is_same_v<C, std::string>){
+		c.resize_and_overwrite(old + len, [&doc, old](char *p, std::size_t n){
+			write(p + old, doc);
+			return n;
+		});
+		return len;
+	}
+#endif
+	c.resize(old + len);
+	write(c.data() + old, doc);
+	return len;
+}
+
+/* Returns the JSON text of 'doc' as string */
+template<typename D>
+std::string
+to_string(const D &doc)
+{
+	std::string s;
+	append(s, doc);
+	return s;
+}
+
+namespace detail {
+
+/* Gives access to the container of a std::back_insert_iterator */
+template<typename C>
+struct inserter_access : std::back_insert_iterator<C> {
+	static C&
+	container_of(const std::back_insert_iterator<C> &it)
+	{
+		return *(it.*(&inserter_access::container));
+	}
+};
+
+template<typename It>
+struct is_contiguous_inserter : std::false_type {};
+
+template<typename C>
+	requires std::is_same_v<typename C::value_type, char>
+		&& requires (C &c) { c.data(); c.resize(0); }
+struct is_contiguous_inserter<std::back_insert_iterator<C>> : std::true_type {};
+
+} // namespace detail
+
+/*
+ * Writes the JSON text of 'doc' to the output iterator 'out' and returns the
+ * iterator behind it. Pointers are written directly, back inserters of a
+ * std::string or std::vector<char> append to the container in place. For
+ * other iterators the text is generated into a buffer on the stack if it is
+ * bounded, or into a string otherwise, and copied.
+ */
+template<typename It, typename D>
+It
+serialize_to(It out, const D &doc)
+{
+	if constexpr (std::is_same_v<It, char*>){
+		return write(out, doc);
+	} else if constexpr (detail::is_contiguous_inserter<It>::value){
+		append(detail::inserter_access<typename It::container_type>::container_of(out), doc);
+		return out;
+	} else if constexpr (detail::bounded<D>){
+		std::array<char, max_size<D>> buf;
+		return std::copy(buf.data(), write(buf.data(), doc), out);
+	} else {
+		const std::string s = to_string(doc);
+		return std::copy(s.begin(), s.end(), out);
+	}
+}
+
+/*
+ * Generator of the JSON text of a descriptor in chunks, returned by
+ * json::chunks(). A chunk is valid until the generator is resumed.
+ */
+class chunk_generator {
+public:
+	/* Yielded to end the generator with an error */
+	struct error {};
+
+	struct promise_type {
+		std::string_view chunk;
+		bool failed = false;
+
+		chunk_generator
+		get_return_object()
+		{
+			return chunk_generator(std::coroutine_handle<promise_type>::from_promise(*this));
+		}
+
+		std::suspend_always initial_suspend() noexcept { return {}; }
+		std::suspend_always final_suspend() noexcept { return {}; }
+		void return_void() noexcept {}
+		void unhandled_exception() { std::terminate(); }
+
+		std::suspend_always
+		yield_value(std::string_view c) noexcept
+		{
+			chunk = c;
+			return {};
+		}
+
+		std::suspend_never
+		yield_value(error) noexcept
+		{
+			failed = true;
+			return {};
+		}
+	};
+
+	class iterator {
+	public:
+		using value_type = std::string_view;
+		using difference_type = std::ptrdiff_t;
+
+		iterator() = default;
+		explicit iterator(std::coroutine_handle<promise_type> handle) : h(handle) {}
+
+		std::string_view operator*() const { return h.promise().chunk; }
+
+		iterator&
+		operator++()
+		{
+			h.resume();
+			return *this;
+		}
+
+		void operator++(int) { ++*this; }
+
+		bool operator==(std::default_sentinel_t) const { return !h || h.done(); }
+
+	private:
+		std::coroutine_handle<promise_type> h;
+	};
+
+	chunk_generator(chunk_generator &&o) noexcept : h(std::exchange(o.h, {})) {}
+	chunk_generator(const chunk_generator&) = delete;
+	chunk_generator& operator=(const chunk_generator&) = delete;
+
+	~chunk_generator()
+	{
+		if (h)
+			h.destroy();
+	}
+
+	iterator
+	begin()
+	{
+		h.resume();
+		return iterator(h);
+	}
+
+	std::default_sentinel_t end() const { return {}; }
+
+	/* Whether the generation ended with an error, the text is incomplete then */
+	bool failed() const { return h && h.promise().failed; }
+
+private:
+	explicit chunk_generator(std::coroutine_handle<promise_type> handle) : h(handle) {}
+
+	std::coroutine_handle<promise_type> h;
+};
+
+/*
+ * Yields the JSON text of 'tjs' in chunks of at most buf.size() - 1 bytes, the
+ * chunks point into 'buf'. Nothing is generated between the chunks, so a
+ * caller can co_await the output of each chunk:
+ *
+ *	auto gen = json::chunks(tjs, buf);
+ *	for (std::string_view chunk : gen)
+ *		co_await socket.write(chunk);
+ *	if (gen.failed())
+ *		...
+ *
+ * Generation ends early in case of an error, e.g. if a number does not fit
+ * into 'buf', and failed() is set.
+ */
+inline chunk_generator
+chunks(const struct to_json *tjs, std::span<char> buf)
+{
+	struct json_reader r;
+	json_reader_init(&r, tjs);
+	while (std::size_t l = json_reader_next(&r, buf.data(), buf.size())){
+		if (l == static_cast<std::size_t>(-1)){
+			co_yield chunk_generator::error{};
+			co_return;
+		}
+		co_yield std::string_view(buf.data(), l);
+	}
+}
+
+} // namespace json
+
+/* Sets the names of the fields of the aggregate 'T' in declaration order */
+#define MTOJSON_NAMES(T, ...) \
+	template<> \
+	struct json::field_names<T> { \
+		static constexpr const char *names[] = { __VA_ARGS__ }; \
+	}
+
+#endif
@@ -0,0 +1,578 @@
+/*
+   SPDX-License-Identifier: BSD-2-Clause
+   This file is Copyright (c) 2020, 2021 by Rene Kita
+*/
+
+#define _DEFAULT_SOURCE
+
+#include "mtojson_io.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#define HAVE_IO_URING
+#endif
+
+static void
+release(struct json_writer *w, unsigned i)
+{
+	w->free |= UINT64_C(1) << i;
+}
+
+static void
+set_error(struct json_writer *w, int err)
+{
+	if (!w->error)
+		w->error = err;
+}
+
+static int
+result(struct json_writer *w)
+{
+	if (!w->error)
+		return 0;
+	errno = w->error;
+	return -1;
+}
+
+/* Writes buffer 'i' with pwrite(), which is only used with an offset */
+static void
+write_at(struct json_writer *w, unsigned i)
+{
+	const char *buf = w->bufs + (size_t)i * w->buf_size;
+	while (w->done[i] < w->len[i]){
+		ssize_t n = pwrite(w->fd[i], buf + w->done[i], w->len[i] - w->done[i],
+				(off_t)w->offset[i] + (off_t)w->done[i]);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0){
+			set_error(w, n ? errno : EIO);
+			break;
+		}
+		w->done[i] += (size_t)n;
+	}
+	release(w, i);
+}
+
+/* Writes the queued buffers from 'first' to 'end' to the same descriptor */
+static void
+write_run(struct json_writer *w, unsigned first, unsigned end)
+{
+	struct iovec iov[JSON_WRITER_MAX_BUFS];
+	unsigned n = 0;
+	for (unsigned k = first; k < end; k++){
+		unsigned i = w->pending[k];
+		iov[n].iov_base = w->bufs + (size_t)i * w->buf_size;
+		iov[n++].iov_len = w->len[i];
+	}
+
+	struct iovec *v = iov;
+	while (n){
+		ssize_t r = writev(w->fd[w->pending[first]], v, (int)n);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0){
+			set_error(w, r ? errno : EIO);
+			break;
+		}
+		for (size_t left = (size_t)r; left; ){
+			size_t l = left < v->iov_len ? left : v->iov_len;
+			v->iov_base = (char*)v->iov_base + l;
+			v->iov_len -= l;
+			left -= l;
+			if (!v->iov_len){
+				v++;
+				n--;
+			}
+		}
+	}
+
+	for (unsigned k = first; k < end; k++)
+		release(w, w->pending[k]);
+}
+
+/* Writes the queued buffers synchronously, a run for the same descriptor at once */
+static void
+submit_writev(struct json_writer *w)
+{
+	unsigned first = 0;
+	for (unsigned k = 0; k < w->queued; k++){
+		unsigned i = w->pending[k];
+		if (w->offset[i] >= 0){
+			write_run(w, first, k);
+			write_at(w, i);
+			first = k + 1;
+		} else if (w->fd[i] != w->fd[w->pending[first]]){
+			write_run(w, first, k);
+			first = k;
+		}
+	}
+	write_run(w, first, w->queued);
+	w->queued = 0;
+}
+
+#ifdef HAVE_IO_URING
+static int
+uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int
+uring_enter(int ring, unsigned submit, unsigned complete, unsigned flags)
+{
+	return (int)syscall(__NR_io_uring_enter, ring, submit, complete, flags, NULL, 0);
+}
+
+static int
+uring_register(int ring, unsigned op, const void *arg, unsigned n)
+{
+	return (int)syscall(__NR_io_uring_register, ring, op, arg, n);
+}
+
+static void
+uring_unmap(struct json_writer *w)
+{
+	if (w->sqes)
+		munmap(w->sqes, w->sqes_size);
+	if (w->cq_ring && w->cq_ring != w->sq_ring)
+		munmap(w->cq_ring, w->cq_ring_size);
+	if (w->sq_ring)
+		munmap(w->sq_ring, w->sq_ring_size);
+	w->sq_ring = w->cq_ring = w->sqes = NULL;
+}
+
+static int
+uring_map(struct json_writer *w, const struct io_uring_params *p)
+{
+	w->sq_ring_size = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+	w->cq_ring_size = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+	if (p->features & IORING_FEAT_SINGLE_MMAP){
+		if (w->cq_ring_size > w->sq_ring_size)
+			w->sq_ring_size = w->cq_ring_size;
+		w->cq_ring_size = w->sq_ring_size;
+	}
+
+	w->sq_ring = mmap(NULL, w->sq_ring_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, w->ring, IORING_OFF_SQ_RING);
+	if (w->sq_ring == MAP_FAILED){
+		w->sq_ring = NULL;
+		return -1;
+	}
+
+	if (p->features & IORING_FEAT_SINGLE_MMAP){
+		w->cq_ring = w->sq_ring;
+	} else {
+		w->cq_ring = mmap(NULL, w->cq_ring_size, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, w->ring, IORING_OFF_CQ_RING);
+		if (w->cq_ring == MAP_FAILED){
+			w->cq_ring = NULL;
+			return -1;
+		}
+	}
+
+	w->sqes_size = p->sq_entries * sizeof(struct io_uring_sqe);
+	w->sqes = mmap(NULL, w->sqes_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, w->ring, IORING_OFF_SQES);
+	if (w->sqes == MAP_FAILED){
+		w->sqes = NULL;
+		return -1;
+	}
+
+	char *sq = w->sq_ring;
+	char *cq = w->cq_ring;
+	w->sq_tail = (unsigned*)(sq + p->sq_off.tail);
+	w->sq_mask = (unsigned*)(sq + p->sq_off.ring_mask);
+	w->sq_array = (unsigned*)(sq + p->sq_off.array);
+	w->cq_head = (unsigned*)(cq + p->cq_off.head);
+	w->cq_tail = (unsigned*)(cq + p->cq_off.tail);
+	w->cq_mask = (unsigned*)(cq + p->cq_off.ring_mask);
+	w->cqes = cq + p->cq_off.cqes;
+	return 0;
+}
+
+static void
+uring_init(struct json_writer *w)
+{
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	if ((w->ring = uring_setup(w->nbufs, &p)) < 0)
+		return;
+
+	if (uring_map(w, &p)){
+		uring_unmap(w);
+		close(w->ring);
+		w->ring = -1;
+		return;
+	}
+
+	/* Registered buffers save mapping the pages on every write, but need
+	 * locked memory, so they are optional */
+	struct iovec iov[JSON_WRITER_MAX_BUFS];
+	for (unsigned i = 0; i < w->nbufs; i++){
+		iov[i].iov_base = w->bufs + (size_t)i * w->buf_size;
+		iov[i].iov_len = w->buf_size;
+	}
+	w->fixed = !uring_register(w->ring, IORING_REGISTER_BUFFERS, iov, w->nbufs);
+}
+
+/* Queues the rest of buffer 'i' in the submission ring */
+static struct io_uring_sqe *
+uring_prep(struct json_writer *w, unsigned i)
+{
+	unsigned tail = *w->sq_tail;
+	unsigned idx = tail & *w->sq_mask;
+	struct io_uring_sqe *sqe = (struct io_uring_sqe*)w->sqes + idx;
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = w->fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+	sqe->fd = w->fd[i];
+	sqe->addr = (uint64_t)(uintptr_t)(w->bufs + (size_t)i * w->buf_size + w->done[i]);
+	sqe->len = (uint32_t)(w->len[i] - w->done[i]);
+	sqe->off = w->offset[i] < 0 ? (uint64_t)-1 : (uint64_t)w->offset[i] + w->done[i];
+	sqe->buf_index = (uint16_t)i;
+	sqe->user_data = i;
+	w->sq_array[idx] = idx;
+	__atomic_store_n(w->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	w->inflight |= UINT64_C(1) << i;
+	return sqe;
+}
+
+/* Returns whether a write at the current position of 'fd' is in flight */
+static _Bool
+stream_busy(const struct json_writer *w, int fd)
+{
+	for (unsigned i = 0; i < w->nbufs; i++)
+		if (w->inflight & UINT64_C(1) << i && w->fd[i] == fd && w->offset[i] < 0)
+			return 1;
+	return 0;
+}
+
+/* Queues the buffers for the stream of pending[k] as a linked chain, so the
+ * kernel writes them in order. Returns the number of buffers. */
+static unsigned
+uring_prep_stream(struct json_writer *w, unsigned k, uint64_t *taken)
+{
+	int fd = w->fd[w->pending[k]];
+	struct io_uring_sqe *sqe = NULL;
+	unsigned n = 0;
+	for ( ; k < w->queued; k++){
+		unsigned i = w->pending[k];
+		if (w->fd[i] != fd || w->offset[i] >= 0)
+			continue;
+		if (sqe)
+			sqe->flags |= IOSQE_IO_LINK;
+		sqe = uring_prep(w, i);
+		*taken |= UINT64_C(1) << k;
+		n++;
+	}
+	return n;
+}
+
+/* Submits the queued buffers, except those that have to wait for an earlier
+ * write to the same stream */
+static void
+uring_submit(struct json_writer *w)
+{
+	uint64_t taken = 0;
+	unsigned n = 0;
+	for (unsigned k = 0; k < w->queued; k++){
+		unsigned i = w->pending[k];
+		if (taken & UINT64_C(1) << k){
+			continue;
+		} else if (w->offset[i] >= 0){
+			uring_prep(w, i);
+			taken |= UINT64_C(1) << k;
+			n++;
+		} else if (!stream_busy(w, w->fd[i])){
+			n += uring_prep_stream(w, k, &taken);
+		}
+	}
+
+	unsigned kept = 0;
+	for (unsigned k = 0; k < w->queued; k++)
+		if (!(taken & UINT64_C(1) << k))
+			w->pending[kept++] = w->pending[k];
+	w->queued = kept;
+
+	while (n){
+		int r = uring_enter(w->ring, n, 0, 0);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0){
+			set_error(w, r ? errno : EIO);
+			return;
+		}
+		n -= (unsigned)r;
+	}
+}
+
+/* Queues buffer 'i' again after a short write, which cancels the rest of its
+ * chain. The queue is kept in the order the documents were written. */
+static void
+requeue(struct json_writer *w, unsigned i)
+{
+	unsigned k = w->queued;
+	while (k && (int)(w->order[w->pending[k - 1]] - w->order[i]) > 0)
+		k--;
+	memmove(w->pending + k + 1, w->pending + k, w->queued - k);
+	w->pending[k] = (unsigned char)i;
+	w->queued++;
+}
+
+/* Handles completions, waits for at least one if 'wait' is set.
+ * Returns -1 if waiting failed. */
+static int
+uring_reap(struct json_writer *w, _Bool wait)
+{
+	while (wait && uring_enter(w->ring, 0, 1, IORING_ENTER_GETEVENTS) < 0){
+		if (errno != EINTR){
+			set_error(w, errno);
+			return -1;
+		}
+	}
+
+	unsigned head = *w->cq_head;
+	unsigned tail = __atomic_load_n(w->cq_tail, __ATOMIC_ACQUIRE);
+	for ( ; head != tail; head++){
+		const struct io_uring_cqe *cqe = (const struct io_uring_cqe*)w->cqes
+			+ (head & *w->cq_mask);
+		unsigned i = (unsigned)cqe->user_data;
+		w->inflight &= ~(UINT64_C(1) << i);
+		if (cqe->res == -ECANCELED || (cqe->res > 0
+					&& (w->done[i] += (size_t)cqe->res) < w->len[i])){
+			requeue(w, i);
+		} else {
+			if (cqe->res <= 0)
+				set_error(w, cqe->res ? -cqe->res : EIO);
+			release(w, i);
+		}
+	}
+	__atomic_store_n(w->cq_head, head, __ATOMIC_RELEASE);
+	return 0;
+}
+#endif
+
+static void
+submit(struct json_writer *w)
+{
+#ifdef HAVE_IO_URING
+	if (w->ring >= 0){
+		uring_submit(w);
+		return;
+	}
+#endif
+	submit_writev(w);
+}
+
+/* Waits for a completion, returns 0 if nothing is in flight */
+static int
+wait_one(struct json_writer *w)
+{
+	if (w->queued)
+		submit(w);
+	if (!w->inflight)
+		return 0;
+#ifdef HAVE_IO_URING
+	if (uring_reap(w, 1))
+		return 0;
+	/* Writes held back for a stream can go now */
+	if (w->queued)
+		submit(w);
+#endif
+	return !w->error;
+}
+
+int
+json_writer_init(struct json_writer *w, char *bufs, size_t buf_size,
+		unsigned nbufs, unsigned flags)
+{
+	if (!nbufs || nbufs > JSON_WRITER_MAX_BUFS || !buf_size){
+		errno = EINVAL;
+		return -1;
+	}
+
+	memset(w, 0, sizeof(*w));
+	w->bufs = bufs;
+	w->buf_size = buf_size;
+	w->nbufs = nbufs;
+	w->batch = nbufs / 2 ? nbufs / 2 : 1;
+	w->ring = -1;
+	w->free = nbufs == 64 ? UINT64_MAX : (UINT64_C(1) << nbufs) - 1;
+#ifdef HAVE_IO_URING
+	if (!(flags & json_writer_no_uring))
+		uring_init(w);
+#else
+	(void)flags;
+#endif
+	return 0;
+}
+
+int
+json_writer_write(struct json_writer *w, int fd, int64_t offset,
+		const struct to_json *tjs)
+{
+#ifdef HAVE_IO_URING
+	if (w->inflight)
+		uring_reap(w, 0);
+#endif
+	while (!w->free && wait_one(w))
+		;
+	if (result(w))
+		return -1;
+
+	unsigned i = (unsigned)__builtin_ctzll(w->free);
+	size_t l = json_generate(w->bufs + (size_t)i * w->buf_size, tjs, w->buf_size);
+	if (!l){
+		errno = ENOBUFS;
+		return -1;
+	}
+
+	w->free &= ~(UINT64_C(1) << i);
+	w->fd[i] = fd;
+	w->offset[i] = offset;
+	w->len[i] = l;
+	w->done[i] = 0;
+	w->order[i] = w->seq++;
+	w->pending[w->queued++] = (unsigned char)i;
+	if (w->queued >= w->batch)
+		submit(w);
+	return result(w);
+}
+
+int
+json_writer_flush(struct json_writer *w)
+{
+	while (wait_one(w))
+		;
+	int r = result(w);
+	w->error = 0;
+	return r;
+}
+
+void
+json_writer_close(struct json_writer *w)
+{
+#ifdef HAVE_IO_URING
+	if (w->ring >= 0){
+		/* The kernel must not write from the buffers after they are
+		 * returned to the caller */
+		while (w->inflight && !uring_reap(w, 1))
+			;
+		uring_unmap(w);
+		close(w->ring);
+		w->ring = -1;
+	}
+#endif
+	w->queued = 0;
+}
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static _Bool
+batch_due(const struct json_batch *b, uint64_t now)
+{
+	return b->max_delay_us && b->count
+		&& now - b->first_ns >= (uint64_t)b->max_delay_us * 1000;
+}
+
+int
+json_batch_flush(struct json_batch *b)
+{
+	size_t done = 0;
+	while (done < b->len){
+		ssize_t n;
+		if (b->not_socket){
+			n = write(b->fd, b->buf + done, b->len - done);
+		} else {
+			n = send(b->fd, b->buf + done, b->len - done, MSG_NOSIGNAL);
+			if (n < 0 && errno == ENOTSOCK){
+				b->not_socket = 1;
+				continue;
+			}
+		}
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0){
+			/* Keep the rest for the next try */
+			int err = n ? errno : EIO;
+			memmove(b->buf, b->buf + done, b->len - done);
+			b->len -= done;
+			errno = err;
+			return -1;
+		}
+		done += (size_t)n;
+	}
+
+	b->len = 0;
+	b->count = 0;
+	return 0;
+}
+
+int
+json_batch_add(struct json_batch *b, const struct to_json *tjs)
+{
+	size_t dlen = b->delim ? strlen(b->delim) : 0;
+	size_t l = 0;
+	if (b->len + dlen < b->size)
+		l = json_generate(b->buf + b->len, tjs, b->size - b->len - dlen);
+	if (!l && b->len){
+		/* A partial flush may make enough room */
+		int ret = json_batch_flush(b);
+		int err = errno;
+		if (b->len + dlen < b->size)
+			l = json_generate(b->buf + b->len, tjs, b->size - b->len - dlen);
+		if (!l && ret){
+			errno = err;
+			return -1;
+		}
+	}
+	if (!l){
+		errno = ENOBUFS;
+		return -1;
+	}
+
+	if (dlen)
+		memcpy(b->buf + b->len + l, b->delim, dlen);
+	b->len += l + dlen;
+	uint64_t now = b->max_delay_us ? now_ns() : 0;
+	if (!b->count++)
+		b->first_ns = now;
+
+	size_t max_len = b->max_len ? b->max_len : b->size;
+	if ((b->len >= max_len || (b->max_count && b->count >= b->max_count)
+			|| batch_due(b, now)) && json_batch_flush(b) && errno != EAGAIN)
+		return -1;
+	return 0;
+}
+
+int
+json_batch_poll(struct json_batch *b, int *timeout)
+{
+	*timeout = -1;
+	if (!b->max_delay_us || !b->count)
+		return 0;
+
+	uint64_t now = now_ns();
+	if (batch_due(b, now))
+		return json_batch_flush(b);
+
+	/* Round up, poll() must not wake up before the deadline */
+	uint64_t left = b->first_ns + (uint64_t)b->max_delay_us * 1000 - now;
+	*timeout = (int)((left + 999999) / 1000000);
+	return 0;
+}
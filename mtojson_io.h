@@ -0,0 +1,137 @@
+/*
+   SPDX-License-Identifier: BSD-2-Clause
+   This file is Copyright (c) 2020, 2021 by Rene Kita
+*/
+
+#ifndef RKTA_MTOJSON_IO_H
+#define RKTA_MTOJSON_IO_H
+
+#include "mtojson.h"
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define JSON_WRITER_MAX_BUFS 64
+
+enum json_writer_flags {
+	json_writer_no_uring = 1, // Always use writev()
+};
+
+/*
+ * Writes generated documents asynchronously with io_uring on Linux, or with
+ * writev() if io_uring is not available. The documents are generated into a
+ * set of buffers provided by the caller, which are registered with the ring
+ * and reused once their write completed. All members are private.
+ */
+struct json_writer {
+	char *bufs;
+	size_t buf_size;
+	unsigned nbufs;
+	unsigned batch;        // Documents per submission
+	int ring;              // -1 if writev() is used
+	_Bool fixed;           // Buffers are registered
+	int error;             // First error as errno value
+	uint64_t free;         // Set of free buffers
+	uint64_t inflight;     // Set of buffers submitted to the ring
+	unsigned queued;       // Buffers not submitted yet
+	unsigned seq;          // Sequence number of the next document
+	unsigned char pending[JSON_WRITER_MAX_BUFS];
+	unsigned order[JSON_WRITER_MAX_BUFS];
+	int fd[JSON_WRITER_MAX_BUFS];
+	int64_t offset[JSON_WRITER_MAX_BUFS];
+	size_t len[JSON_WRITER_MAX_BUFS];
+	size_t done[JSON_WRITER_MAX_BUFS];
+
+	/* Ring mappings */
+	void *sq_ring;
+	size_t sq_ring_size;
+	void *cq_ring;
+	size_t cq_ring_size;
+	void *sqes;
+	size_t sqes_size;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	void *cqes;
+};
+
+/*
+ * Initializes 'w' with 'nbufs' buffers of 'buf_size' bytes each at 'bufs'.
+ * Falls back to writev() if io_uring can't be set up, see 'flags'.
+ * Returns 0 or -1 with errno set.
+ */
+int json_writer_init(struct json_writer *w, char *bufs, size_t buf_size,
+		unsigned nbufs, unsigned flags);
+
+/*
+ * Generates the document 'tjs' into a free buffer and queues it to be written
+ * to 'fd' at 'offset', or at the current position if 'offset' is -1. Waits for
+ * a buffer if all are in use. Queued documents are submitted in batches.
+ * Writes at the current position of the same descriptor are done in order, one
+ * at a time, while the following documents are generated.
+ * Returns 0 or -1 if the document does not fit into a buffer or a previous
+ * write failed, with errno set.
+ */
+int json_writer_write(struct json_writer *w, int fd, int64_t offset,
+		const struct to_json *tjs);
+
+/*
+ * Submits all queued documents and waits until all are written.
+ * Returns 0 or -1 with errno set to the first error.
+ */
+int json_writer_flush(struct json_writer *w);
+
+/* Releases the ring, queued documents are discarded */
+void json_writer_close(struct json_writer *w);
+
+/*
+ * Collects small documents in 'buf' to write them to 'fd' with a single
+ * send() or write(). Set the members up to '.max_delay_us', the others must
+ * be 0.
+ */
+struct json_batch {
+	int fd;
+	char *buf;
+	size_t size;            // Size of 'buf'
+	const char *delim;      // Appended to every document, may be NULL
+	size_t max_len;         // Flush at this many bytes, 0 to flush when full
+	unsigned max_count;     // Flush at this many documents, 0 for no limit
+	unsigned max_delay_us;  // Flush when the oldest document is this old, or 0
+	size_t len;             // Bytes not written yet
+	unsigned count;         // Documents in the batch
+	uint64_t first_ns;      // Time the oldest document was added
+	_Bool not_socket;
+};
+
+/*
+ * Generates the document 'tjs' at the end of the batch. The batch is flushed
+ * before if the document does not fit and after if a limit is reached.
+ * Returns 0 if the document was added, or -1 with errno set. ENOBUFS means the
+ * document does not fit into an empty batch, EAGAIN that a non-blocking 'fd'
+ * is full and the document was not added, add it again once 'fd' is writable.
+ * If only the flush after adding fails with EAGAIN, 0 is returned and the
+ * batch is written by the next flush.
+ */
+int json_batch_add(struct json_batch *b, const struct to_json *tjs);
+
+/* Writes all batched documents. Returns 0 or -1 with errno set. */
+int json_batch_flush(struct json_batch *b);
+
+/*
+ * Flushes the batch if its oldest document reached '.max_delay_us'. Sets
+ * 'timeout' to the milliseconds until the next flush is due, or -1 if none is,
+ * as suitable for poll(). Returns 0 or -1 with errno set.
+ */
+int json_batch_poll(struct json_batch *b, int *timeout);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
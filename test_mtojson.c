@@ -8,7 +8,8 @@
  * will be aborted immediately with an exit status 124.
  *
  * If json_generate returns the wrong string length, running tests will be
- * aborted immediately with an exit status 123.
+ * aborted immediately with an exit status 123. The same applies if
+ * json_generate_size returns the wrong length for a too small buffer.
  *
  * If tests fail exit status is the count of failed tests. All succeeding tests
  * will be run and the number of the failed tests will be printed to stderr.
@@ -22,16 +23,25 @@
  * This file is Copyright (c) 2020, 2021 by Rene Kita
  */
 
+#define _POSIX_C_SOURCE 200809L
+
 #include "mtojson.h"
+#include "mtojson_io.h"
 
+#include <arpa/inet.h>
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <limits.h>
+#include <netinet/in.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <time.h>
 #include <unistd.h>
 
 enum { MAXLEN = 512 };
@@ -92,6 +102,15 @@ run_test(char *test, char *expected, char *result, const struct to_json *tjs, si
 		exit(125);
 	}
 
+	memset(result, '\0', len);
+	if (json_generate_size(result, tjs, len / 2) != l
+			|| strncmp(result, expected, strlen(result))
+			|| json_generate_size(NULL, tjs, 0) != l) {
+		if (verbose)
+			printf("%s\n", "Required length mismatch");
+		exit(123);
+	}
+
 	return err;
 }
 
@@ -717,6 +736,1155 @@ test_c_array_hex(void)
 	return run_test(test, expected, result, &tjs, len);
 }
 
+static int
+test_object_map(void)
+{
+	char *expected = "{\"tags\":{\"room\":\"kitchen\",\"fl\\\"oor\":\"1\"},"
+	                  "\"hist\":{\"a\":3,\"bb\":-1,\"ccc\":0}}";
+	char *test = "test_object_map";
+	size_t len = strlen(expected) + 1;
+	assert(len <= MAXLEN);
+	char result[MAXLEN];
+	rp = result;
+
+	const char *tag_keys[] = { "room", "fl\"oor" };
+	const char *tag_values[] = { "kitchen", "1" };
+	const size_t tag_cnt = sizeof(tag_keys) / sizeof(tag_keys[0]);
+	const struct to_json_map tags = {
+		.keys = tag_keys, .values = tag_values, .count = &tag_cnt, .vtype = t_to_string,
+	};
+
+	/* Keys are not NUL terminated */
+	const char *hist_keys[] = { "ax", "bbx", "cccx" };
+	const size_t hist_lens[] = { 1, 2, 3 };
+	const int hist_values[] = { 3, -1, 0 };
+	const size_t hist_cnt = sizeof(hist_values) / sizeof(hist_values[0]);
+	const struct to_json_map hist = {
+		.keys = hist_keys, .key_lens = hist_lens, .values = hist_values,
+		.count = &hist_cnt, .vtype = t_to_int,
+	};
+
+	const struct to_json tjs[] = {
+		{ .name = "tags", .value = &tags, .vtype = t_to_map, .stype = t_to_object, },
+		{ .name = "hist", .value = &hist, .vtype = t_to_map, },
+		{ NULL }
+	};
+	return run_test(test, expected, result, tjs, len);
+}
+
+static int
+test_primitive_map_empty(void)
+{
+	char *expected = "{}";
+	char *test = "test_primitive_map_empty";
+	size_t len = strlen(expected) + 1;
+	assert(len <= MAXLEN);
+	char result[MAXLEN];
+	rp = result;
+
+	const char *keys[1];
+	const unsigned values[1];
+	const size_t cnt = 0;
+	const struct to_json_map map = {
+		.keys = keys, .values = values, .count = &cnt, .vtype = t_to_uint,
+	};
+	const struct to_json tjs = { .value = &map, .vtype = t_to_map, };
+	return run_test(test, expected, result, &tjs, len);
+}
+
+static int
+test_truncated(void)
+{
+	char *expected = "{\"a\":1,\"b\":[1,2]}";
+	char *complete = "{\"a\":1,\"b\":[1,2,3,4],\"c\":\"x\"}";
+	char *test = "test_truncated";
+	size_t len = strlen(expected) + 1;
+	assert(len <= MAXLEN);
+	char result[MAXLEN];
+	rp = result;
+
+	tell_single_test(test);
+
+	const int one = 1;
+	const int arr[] = {1, 2, 3, 4};
+	const size_t cnt = sizeof(arr) / sizeof(arr[0]);
+	const struct to_json tjs[] = {
+		{ .name = "a", .value = &one, .vtype = t_to_int, .stype = t_to_object, },
+		{ .name = "b", .value = arr, .count = &cnt, .vtype = t_to_int, },
+		{ .name = "c", .value = "x", .vtype = t_to_string, },
+		{ NULL }
+	};
+
+	int err = 0;
+	size_t omitted = 0;
+	size_t l = json_generate_truncated(result, tjs, len, &omitted);
+	if (l != strlen(expected) || strcmp(result, expected) || omitted != 3){
+		fprintf(stderr, "\nFAILED: %s\n", test);
+		fprintf(stderr, "Expected : %s, 3 omitted\n", expected);
+		fprintf(stderr, "Generated: %s, %zu omitted\n", result, omitted);
+		err = 1;
+	}
+
+	l = json_generate_truncated(result, tjs, MAXLEN, &omitted);
+	if (l != strlen(complete) || strcmp(result, complete) || omitted != 0){
+		fprintf(stderr, "\nFAILED: %s\n", test);
+		fprintf(stderr, "Expected : %s, 0 omitted\n", complete);
+		fprintf(stderr, "Generated: %s, %zu omitted\n", result, omitted);
+		err = 1;
+	}
+
+	if (json_generate_truncated(result, tjs, 2, &omitted))
+		exit(125);
+
+	return err;
+}
+
+static int
+test_prioritized(void)
+{
+	char *expected = "{\"id\":7,\"temp\":21,\"rssi\":-70}";
+	char *complete = "{\"id\":7,\"temp\":21,\"diag\":\"verbose diagnostics\",\"rssi\":-70,\"up\":1234}";
+	char *test = "test_prioritized";
+	size_t len = 32;
+	char result[MAXLEN];
+	rp = result;
+
+	tell_single_test(test);
+
+	const int id = 7;
+	const int temp = 21;
+	const int rssi = -70;
+	const unsigned up = 1234;
+	const struct to_json tjs[] = {
+		{ .name = "id", .value = &id, .vtype = t_to_int, .stype = t_to_object, },
+		{ .name = "temp", .value = &temp, .vtype = t_to_int, .priority = 1, },
+		{ .name = "diag", .value = "verbose diagnostics", .vtype = t_to_string, .priority = 3, },
+		{ .name = "rssi", .value = &rssi, .vtype = t_to_int, .priority = 2, },
+		{ .name = "up", .value = &up, .vtype = t_to_uint, .priority = 2, },
+		{ NULL }
+	};
+
+	int err = 0;
+	size_t omitted = 0;
+	size_t l = json_generate_prioritized(result, tjs, len, &omitted);
+	if (l != strlen(expected) || strcmp(result, expected) || omitted != 2){
+		fprintf(stderr, "\nFAILED: %s\n", test);
+		fprintf(stderr, "Expected : %s, 2 omitted\n", expected);
+		fprintf(stderr, "Generated: %s, %zu omitted\n", result, omitted);
+		err = 1;
+	}
+
+	l = json_generate_prioritized(result, tjs, strlen(complete) + 1, &omitted);
+	if (l != strlen(complete) || strcmp(result, complete) || omitted != 0){
+		fprintf(stderr, "\nFAILED: %s\n", test);
+		fprintf(stderr, "Expected : %s, 0 omitted\n", complete);
+		fprintf(stderr, "Generated: %s, %zu omitted\n", result, omitted);
+		err = 1;
+	}
+
+	/* The mandatory member does not fit */
+	if (json_generate_prioritized(result, tjs, 8, &omitted))
+		exit(125);
+
+	return err;
+}
+
+static int
+collect_document(const char *json, size_t len, void *arg)
+{
+	char *docs = arg;
+	if (len != strlen(json))
+		exit(123);
+	strcat(docs, json);
+	strcat(docs, "\n");
+	return 0;
+}
+
+static int
+test_split(void)
+{
+	char *expected = "{\"dev\":\"a1\",\"chunk\":0,\"chunks\":4,\"data\":[1,22,333]}\n"
+	                 "{\"dev\":\"a1\",\"chunk\":1,\"chunks\":4,\"data\":[4444]}\n"
+	                 "{\"dev\":\"a1\",\"chunk\":2,\"chunks\":4,\"data\":[55555,6]}\n"
+	                 "{\"dev\":\"a1\",\"chunk\":3,\"chunks\":4,\"data\":[7]}\n";
+	char *test = "test_split";
+	size_t len = 52;
+	char result[MAXLEN];
+	char docs[MAXLEN] = "";
+	rp = result;
+
+	tell_single_test(test);
+
+	const int arr[] = {1, 22, 333, 4444, 55555, 6, 7};
+	const size_t cnt = sizeof(arr) / sizeof(arr[0]);
+	struct json_split split = { .send = collect_document, .arg = docs, };
+	const struct to_json tjs[] = {
+		{ .name = "dev", .value = "a1", .vtype = t_to_string, .stype = t_to_object, },
+		{ .name = "chunk", .value = &split.index, .vtype = t_to_uint, },
+		{ .name = "chunks", .value = &split.total, .vtype = t_to_uint, },
+		{ .name = "data", .value = arr, .count = &cnt, .vtype = t_to_int, },
+		{ NULL }
+	};
+
+	int err = 0;
+	unsigned n = json_generate_split(result, tjs, len, &split);
+	if (n != 4 || strcmp(docs, expected)){
+		fprintf(stderr, "\nFAILED: %s\n", test);
+		fprintf(stderr, "Expected :\n%s", expected);
+		fprintf(stderr, "Generated: %u documents\n%s", n, docs);
+		err = 1;
+	}
+
+	/* 55555 does not fit next to the header */
+	if (json_generate_split(result, tjs, len - 4, &split))
+		exit(125);
+
+	return err;
+}
+
+static int
+test_generate_size(void)
+{
+	char expected[MAXLEN];
+	char *test = "test_generate_size";
+	char result[MAXLEN];
+	rp = result;
+
+	tell_single_test(test);
+
+	char str[200];
+	memset(str, 'x', sizeof(str) - 1);
+	str[sizeof(str) - 1] = '\0';
+	str[100] = '"';
+
+	const int arr[] = { 1, 2, 3 };
+	const size_t cnt = sizeof(arr) / sizeof(arr[0]);
+	const struct to_json tjs[] = {
+		{ .name = str, .value = str, .vtype = t_to_string, .stype = t_to_object, },
+		{ .name = "arr", .value = arr, .count = &cnt, .vtype = t_to_int, },
+		{ NULL }
+	};
+
+	size_t l = json_generate(expected, tjs, MAXLEN);
+	assert(l);
+
+	int err = 0;
+	for (size_t len = 1; len < l + 2; len += 7){
+		size_t size = json_generate_size(result, tjs, len);
+		if (size != l || (len <= l && strncmp(result, expected, strlen(result)))
+				|| (len > l && strcmp(result, expected))){
+			fprintf(stderr, "\nFAILED: %s\n", test);
+			fprintf(stderr, "Expected : %zu\n", l);
+			fprintf(stderr, "Generated: %zu, buffer %zu\n", size, len);
+			err = 1;
+		}
+	}
+
+	/* Nested deeper than the scratch buffer used for counting */
+	enum { DEEP = 80 };
+	const int one = 1;
+	struct to_json deep[DEEP][2];
+	memset(deep, 0, sizeof(deep));
+	for (size_t i = 0; i < DEEP - 1; i++){
+		deep[i][0].value = deep[i + 1];
+		deep[i][0].vtype = t_to_array;
+	}
+	deep[DEEP - 1][0].value = &one;
+	deep[DEEP - 1][0].vtype = t_to_int;
+	deep[0][0].stype = t_to_array;
+
+	l = json_generate(expected, deep[0], MAXLEN);
+	assert(l == 2 * DEEP + 1);
+	const size_t deep_lens[] = { 0, 1, 10, l, l + 1 };
+	for (size_t i = 0; i < sizeof(deep_lens) / sizeof(deep_lens[0]); i++){
+		size_t len = deep_lens[i];
+		size_t size = json_generate_size(len ? result : NULL, deep[0], len);
+		if (size != l || (len > l && strcmp(result, expected))){
+			fprintf(stderr, "\nFAILED: %s\n", test);
+			fprintf(stderr, "Expected : %zu\n", l);
+			fprintf(stderr, "Generated: %zu, buffer %zu\n", size, len);
+			err = 1;
+		}
+	}
+
+	return err;
+}
+
+static void
+fill_test_header(char *header, size_t header_len, const char *body, size_t len,
+		void *arg)
+{
+	unsigned char sum = 0;
+	for (size_t i = 0; i < len; i++)
+		sum = (unsigned char)(sum + (unsigned char)body[i]);
+
+	assert(header_len == 3);
+	header[0] = *(char*)arg;
+	header[1] = (char)len;
+	header[2] = (char)sum;
+}
+
+static int
+check_frame(const char *test, const char *frame, size_t frame_len,
+		const char *expected, size_t expected_len)
+{
+	if (frame && frame_len == expected_len && !memcmp(frame, expected, frame_len))
+		return 0;
+
+	fprintf(stderr, "\nFAILED: %s\n", test);
+	fprintf(stderr, "Expected : %zu bytes\n", expected_len);
+	fprintf(stderr, "Generated: %zu bytes\n", frame ? frame_len : 0);
+	return 1;
+}
+
+static int
+test_framed(void)
+{
+	char *test = "test_framed";
+	char result[MAXLEN];
+	rp = result;
+
+	tell_single_test(test);
+
+	char str[201];
+	memset(str, 'x', sizeof(str) - 1);
+	str[sizeof(str) - 1] = '\0';
+	const struct to_json tjs = { .value = str, .vtype = t_to_string, };
+	const struct to_json tjs_short = { .value = "ab", .vtype = t_to_string, };
+
+	int err = 0;
+	size_t l;
+	char *frame;
+
+	struct json_frame fr = { .type = json_frame_u16be, };
+	frame = json_generate_framed(result, &tjs_short, MAXLEN, &fr, &l);
+	err += check_frame(test, frame, l, "\x00\x04\"ab\"", 6);
+
+	fr.type = json_frame_u32le;
+	frame = json_generate_framed(result, &tjs_short, MAXLEN, &fr, &l);
+	err += check_frame(test, frame, l, "\x04\x00\x00\x00\"ab\"", 8);
+
+	/* 202 needs two bytes */
+	char long_frame[204] = "\xCA\x01\"";
+	memset(long_frame + 3, 'x', 200);
+	long_frame[203] = '"';
+	fr.type = json_frame_varint;
+	frame = json_generate_framed(result, &tjs, MAXLEN, &fr, &l);
+	err += check_frame(test, frame, l, long_frame, sizeof(long_frame));
+
+	frame = json_generate_framed(result, &tjs_short, MAXLEN, &fr, &l);
+	err += check_frame(test, frame, l, "\x04\"ab\"", 5);
+
+	char tag = 'T';
+	struct json_frame custom = {
+		.type = json_frame_custom, .header_len = 3, .fill = fill_test_header, .arg = &tag,
+	};
+	frame = json_generate_framed(result, &tjs_short, MAXLEN, &custom, &l);
+	err += check_frame(test, frame, l, "T\x04\x07\"ab\"", 7);
+
+	/* Header and text don't fit */
+	if (json_generate_framed(result, &tjs_short, 6, &custom, &l))
+		exit(125);
+
+	return err;
+}
+
+/* Descriptor of a document which is longer than the buffers of the stream tests */
+static const struct to_json *
+stream_test_json(void)
+{
+	static const int arr[] = { 100, -200, 300, -400, 500, -600, 700, -800, 900 };
+	static const size_t cnt = sizeof(arr) / sizeof(arr[0]);
+	static const struct to_json inner[] = {
+		{ .name = "values", .value = arr, .count = &cnt, .vtype = t_to_int, .stype = t_to_object, },
+		{ .name = "a rather long member name", .value = "and a \"rather\" long string value", .vtype = t_to_string, },
+		{ NULL }
+	};
+	static const struct to_json tjs[] = {
+		{ .name = "first", .value = inner, .vtype = t_to_object, .stype = t_to_object, },
+		{ .name = "second", .value = inner, .vtype = t_to_object, },
+		{ .name = "third", .value = arr, .count = &cnt, .vtype = t_to_int, },
+		{ NULL }
+	};
+	return tjs;
+}
+
+struct collected {
+	char data[MAXLEN];
+	size_t len;
+	size_t max_chunk;
+};
+
+static int
+collect_stream(const char *data, size_t len, void *arg)
+{
+	struct collected *c = arg;
+	if (c->len + len >= sizeof(c->data))
+		return 1;
+	memcpy(c->data + c->len, data, len);
+	c->len += len;
+	c->data[c->len] = '\0';
+	if (len > c->max_chunk)
+		c->max_chunk = len;
+	return 0;
+}
+
+static int
+test_stream(void)
+{
+	char expected[MAXLEN];
+	char *test = "test_stream";
+	char buf[32];
+
+	tell_single_test(test);
+
+	const struct to_json *tjs = stream_test_json();
+	size_t l = json_generate(expected, tjs, MAXLEN);
+	assert(l);
+
+	int err = 0;
+	for (size_t len = 24; len <= sizeof(buf); len += 4){
+		struct collected c = { .len = 0 };
+		size_t sl = json_generate_stream(buf, tjs, len, collect_stream, &c);
+		if (sl != l || c.len != l || strcmp(c.data, expected) || c.max_chunk >= len){
+			fprintf(stderr, "\nFAILED: %s\n", test);
+			fprintf(stderr, "Expected : %s\n", expected);
+			fprintf(stderr, "Generated: %s, buffer %zu\n", c.data, len);
+			err = 1;
+		}
+	}
+
+	return err;
+}
+
+struct nested {
+	struct collected c;
+	int err;
+};
+
+/* Generates JSON text from within the sink, the outer stream must not notice */
+static int
+collect_nested(const char *data, size_t len, void *arg)
+{
+	struct nested *n = arg;
+	static const int val = 42;
+	static const struct to_json inner[] = {
+		{ .name = "x", .value = &val, .vtype = t_to_int, .stype = t_to_object, },
+		{ NULL }
+	};
+	char out[16];
+	char buf[16];
+	struct collected c = { .len = 0 };
+
+	if (json_generate(out, inner, sizeof(out)) != 8 || strcmp(out, "{\"x\":42}"))
+		n->err = 1;
+	/* One level of nesting is allowed by default, its sink can't be called */
+	if (json_generate_stream(buf, inner, sizeof(buf), collect_stream, &c))
+		n->err = 1;
+	return collect_stream(data, len, &n->c);
+}
+
+static int
+test_stream_nested(void)
+{
+	char expected[MAXLEN];
+	char *test = "test_stream_nested";
+	char buf[32];
+
+	tell_single_test(test);
+
+	const struct to_json *tjs = stream_test_json();
+	size_t l = json_generate(expected, tjs, MAXLEN);
+	assert(l);
+
+	struct nested n = { .c.len = 0 };
+	size_t sl = json_generate_stream(buf, tjs, sizeof(buf), collect_nested, &n);
+	if (n.err || sl != l || n.c.len != l || strcmp(n.c.data, expected)){
+		fprintf(stderr, "\nFAILED: %s\n", test);
+		fprintf(stderr, "Expected : %s, length %zu\n", expected, l);
+		fprintf(stderr, "Generated: %s, length %zu\n", n.c.data, sl);
+		return 1;
+	}
+
+	return 0;
+}
+
+static int
+send_all(const char *data, size_t len, void *arg)
+{
+	int fd = *(int*)arg;
+	while (len){
+		ssize_t n = send(fd, data, len, 0);
+		if (n < 0)
+			return 1;
+		data += n;
+		len -= (size_t)n;
+	}
+	return 0;
+}
+
+/* Decodes chunked transfer encoding, returns the size of the largest chunk */
+static size_t
+dechunk(const char *in, char *out, size_t *max_chunk)
+{
+	size_t len = 0;
+	size_t n;
+	*max_chunk = 0;
+	do {
+		const char *start = in;
+		char *end;
+		n = strtoul(in, &end, 16);
+		if (strncmp(end, "\r\n", 2))
+			return 0;
+		in = end + 2;
+		memcpy(out + len, in, n);
+		len += n;
+		in += n;
+		if (strncmp(in, "\r\n", 2))
+			return 0;
+		in += 2;
+		if ((size_t)(in - start) > *max_chunk)
+			*max_chunk = (size_t)(in - start);
+	} while (n);
+
+	out[len] = '\0';
+	return *in ? 0 : len;
+}
+
+static int
+test_chunked_loopback(void)
+{
+	char expected[MAXLEN];
+	char received[2 * MAXLEN];
+	char decoded[MAXLEN];
+	char *test = "test_chunked_loopback";
+	char buf[40];
+
+	tell_single_test(test);
+
+	const struct to_json *tjs = stream_test_json();
+	size_t l = json_generate(expected, tjs, MAXLEN);
+	assert(l);
+
+	struct sockaddr_in addr = { .sin_family = AF_INET, };
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t alen = sizeof(addr);
+	int srv = socket(AF_INET, SOCK_STREAM, 0);
+	int cli = socket(AF_INET, SOCK_STREAM, 0);
+	if (srv < 0 || cli < 0
+			|| bind(srv, (struct sockaddr*)&addr, sizeof(addr))
+			|| listen(srv, 1)
+			|| getsockname(srv, (struct sockaddr*)&addr, &alen)
+			|| connect(cli, (struct sockaddr*)&addr, sizeof(addr))){
+		fprintf(stderr, "\nSKIPPED: %s: no loopback networking\n", test);
+		return 0;
+	}
+	int con = accept(srv, NULL, NULL);
+	assert(con >= 0);
+
+	size_t sl = json_generate_chunked(buf, tjs, sizeof(buf), send_all, &con);
+	close(con);
+	close(srv);
+
+	size_t rlen = 0;
+	ssize_t n;
+	while ((n = recv(cli, received + rlen, sizeof(received) - 1 - rlen, 0)) > 0)
+		rlen += (size_t)n;
+	received[rlen] = '\0';
+	close(cli);
+
+	size_t max_chunk;
+	if (sl != l || dechunk(received, decoded, &max_chunk) != l
+			|| strcmp(decoded, expected) || max_chunk > sizeof(buf)){
+		fprintf(stderr, "\nFAILED: %s\n", test);
+		fprintf(stderr, "Expected : %s\n", expected);
+		fprintf(stderr, "Received : %s\n", received);
+		return 1;
+	}
+
+	return 0;
+}
+
+/* Bitwise reference implementations */
+static uint32_t
+ref_crc32c(const char *p, size_t len)
+{
+	uint32_t crc = 0xFFFFFFFF;
+	while (len--){
+		crc ^= (unsigned char)*p++;
+		for (int i = 0; i < 8; i++)
+			crc = (crc >> 1) ^ (0x82F63B78 & -(crc & 1));
+	}
+	return ~crc;
+}
+
+static uint64_t
+ref_fnv1a(const char *p, size_t len)
+{
+	uint64_t hash = 0xCBF29CE484222325;
+	while (len--){
+		hash ^= (unsigned char)*p++;
+		hash *= 0x100000001B3;
+	}
+	return hash;
+}
+
+static int
+test_digest(void)
+{
+	char expected[MAXLEN];
+	char *test = "test_digest";
+	char result[MAXLEN];
+	rp = result;
+
+	tell_single_test(test);
+
+	int err = 0;
+	struct json_digest d = { .types = json_digest_crc32c | json_digest_hash, };
+
+	/* Check values of CRC-32C and FNV-1a */
+	const struct to_json check = { .value = "123456789", .vtype = t_to_value, };
+	if (json_generate_digest(result, &check, MAXLEN, &d) != 9
+			|| d.crc32c != 0xE3069283 || d.hash != 0x06D5573923C6CDFC){
+		fprintf(stderr, "\nFAILED: %s\n", test);
+		fprintf(stderr, "Generated: %08lX %016llX\n", (unsigned long)d.crc32c,
+				(unsigned long long)d.hash);
+		err = 1;
+	}
+
+	/* Crosses several digest windows and stream buffers */
+	char str[160];
+	memset(str, 'x', sizeof(str) - 1);
+	str[sizeof(str) - 1] = '\0';
+	const struct to_json *inner = stream_test_json();
+	const struct to_json tjs[] = {
+		{ .name = "str", .value = str, .vtype = t_to_string, .stype = t_to_object, },
+		{ .name = "inner", .value = inner, .vtype = t_to_object, },
+		{ NULL }
+	};
+	size_t l = json_generate(expected, tjs, MAXLEN);
+	assert(l > 256);
+	uint32_t crc = ref_crc32c(expected, l);
+	uint64_t hash = ref_fnv1a(expected, l);
+
+	d.crc32c = 0;
+	d.hash = 0;
+	if (json_generate_digest(result, tjs, l + 1, &d) != l || strcmp(result, expected)
+			|| d.crc32c != crc || d.hash != hash){
+		fprintf(stderr, "\nFAILED: %s\n", test);
+		fprintf(stderr, "Expected : %s\n", expected);
+		fprintf(stderr, "Generated: %s\n", result);
+		err = 1;
+	}
+
+	if (json_generate_digest(result, tjs, l, &d))
+		exit(125);
+
+	struct collected c = { .len = 0 };
+	char buf[48];
+	d.types = json_digest_crc32c;
+	if (json_generate_stream_digest(buf, tjs, sizeof(buf), collect_stream, &c, &d) != l
+			|| strcmp(c.data, expected) || d.crc32c != crc){
+		fprintf(stderr, "\nFAILED: %s\n", test);
+		fprintf(stderr, "Expected : %s\n", expected);
+		fprintf(stderr, "Generated: %s\n", c.data);
+		err = 1;
+	}
+
+	return err;
+}
+
+static int
+test_cached(void)
+{
+	char *test = "test_cached";
+	char result[MAXLEN];
+
+	tell_single_test(test);
+
+	int n = 1;
+	char str[] = "abc";
+	const int arr[] = { 1, 2, 3 };
+	size_t cnt = 3;
+	const struct to_json tjs[] = {
+		{ .name = "n", .value = &n, .vtype = t_to_int, .stype = t_to_object, },
+		{ .name = "str", .value = str, .vtype = t_to_string, },
+		{ .name = "arr", .value = arr, .count = &cnt, .vtype = t_to_int, },
+		{ NULL }
+	};
+	struct json_cache cache = { .len = 0 };
+
+	struct {
+		const char *expected;
+		unsigned long hits;
+	} steps[] = {
+		{ "{\"n\":1,\"str\":\"abc\",\"arr\":[1,2,3]}", 0 },
+		{ "{\"n\":1,\"str\":\"abc\",\"arr\":[1,2,3]}", 1 },
+		{ "{\"n\":2,\"str\":\"abc\",\"arr\":[1,2,3]}", 1 },
+		{ "{\"n\":2,\"str\":\"abd\",\"arr\":[1,2,3]}", 1 },
+		{ "{\"n\":2,\"str\":\"abd\",\"arr\":[1,2]}", 1 },
+		{ "{\"n\":2,\"str\":\"abd\",\"arr\":[1,2]}", 2 },
+	};
+
+	int err = 0;
+	for (size_t i = 0; i < sizeof(steps) / sizeof(steps[0]); i++){
+		switch (i) {
+		case 2: n = 2; break;
+		case 3: str[2] = 'd'; break;
+		case 4: cnt = 2; break;
+		}
+
+		size_t l = json_generate_cached(result, tjs, MAXLEN, &cache);
+		if (l != strlen(steps[i].expected) || strcmp(result, steps[i].expected)
+				|| cache.hits != steps[i].hits || cache.misses != i + 1 - steps[i].hits){
+			fprintf(stderr, "\nFAILED: %s, step %zu\n", test, i);
+			fprintf(stderr, "Expected : %s\n", steps[i].expected);
+			fprintf(stderr, "Generated: %s\n", result);
+			err = 1;
+		}
+	}
+
+	return err;
+}
+
+static int
+test_const(void)
+{
+	char *test = "test_const";
+	char result[MAXLEN];
+
+	tell_single_test(test);
+
+	/* Read-only descriptors, only the buffers are written */
+	static char fw[] = "1.2";
+	static const struct to_json info[] = {
+		{ .name = "fw", .value = fw, .vtype = t_to_string, .stype = t_to_object, },
+		{ .name = "model", .value = "X1", .vtype = t_to_string, },
+		{ NULL }
+	};
+	static char buf[32];
+	static size_t generated_len, small_len;
+	static const struct to_json_const generated = { .tjs = info, .buf = buf,
+		.size = sizeof(buf), .buf_len = &generated_len, };
+	static const struct to_json_const small = { .tjs = info, .buf = buf, .size = 8,
+		.buf_len = &small_len, };
+	static const struct to_json_const pregenerated = { .text = "[1,2]", .len = 5, };
+	const struct to_json tjs[] = {
+		{ .name = "generated", .value = &generated, .vtype = t_to_const, .stype = t_to_object, },
+		{ .name = "small", .value = &small, .vtype = t_to_const, },
+		{ .name = "pregenerated", .value = &pregenerated, .vtype = t_to_const, },
+		{ NULL }
+	};
+
+	int err = 0;
+	char *expected[] = {
+		"{\"generated\":{\"fw\":\"1.2\",\"model\":\"X1\"},\"small\":{\"fw\":\"1.2\",\"model\":\"X1\"},\"pregenerated\":[1,2]}",
+		/* Only the subtree which is too large for its buffer is generated again */
+		"{\"generated\":{\"fw\":\"1.2\",\"model\":\"X1\"},\"small\":{\"fw\":\"1.3\",\"model\":\"X1\"},\"pregenerated\":[1,2]}",
+	};
+	for (int i = 0; i < 2; i++){
+		size_t l = json_generate(result, tjs, MAXLEN);
+		if (l != strlen(expected[i]) || strcmp(result, expected[i])){
+			fprintf(stderr, "\nFAILED: %s\n", test);
+			fprintf(stderr, "Expected : %s\n", expected[i]);
+			fprintf(stderr, "Generated: %s\n", result);
+			err = 1;
+		}
+		fw[2] = '3';
+	}
+	const char *saved = "{\"fw\":\"1.2\",\"model\":\"X1\"}";
+	if (generated_len != strlen(saved) || strcmp(buf, saved) || small_len)
+		err = 1;
+
+	/* Not saved if the buffer was flushed in between */
+	fw[2] = '2';
+	generated_len = 0;
+	struct collected c = { .len = 0 };
+	char sbuf[24];
+	if (json_generate_stream(sbuf, tjs, sizeof(sbuf), collect_stream, &c) != strlen(expected[0])
+			|| strcmp(c.data, expected[0]) || generated_len)
+		err = 1;
+
+	return err;
+}
+
+static int
+test_delta(void)
+{
+	char *test = "test_delta";
+	char result[MAXLEN];
+
+	tell_single_test(test);
+
+	int temp = 20, hum = 50;
+	const int arr[] = { 1, 2 };
+	size_t cnt = 2;
+	unsigned clock = 1, temp_ver = 1, hum_ver = 1, arr_ver = 1;
+	const struct to_json sensors[] = {
+		{ .name = "temp", .value = &temp, .vtype = t_to_int, .version = &temp_ver, .stype = t_to_object, },
+		{ .name = "hum", .value = &hum, .vtype = t_to_int, .version = &hum_ver, },
+		{ NULL }
+	};
+	const struct to_json tjs[] = {
+		{ .name = "id", .value = "dev", .vtype = t_to_string, .stype = t_to_object, },
+		{ .name = "sensors", .value = sensors, .vtype = t_to_object, },
+		{ .name = "arr", .value = arr, .count = &cnt, .vtype = t_to_int, .version = &arr_ver, },
+		{ NULL }
+	};
+
+	int err = 0;
+	struct {
+		unsigned since;
+		const char *expected;
+	} steps[] = {
+		{ 0, "{\"sensors\":{\"temp\":20,\"hum\":50},\"arr\":[1,2]}" },
+		{ 1, "{}" },
+		{ 1, "{\"sensors\":{\"hum\":51}}" },
+		{ 2, "{\"arr\":[1,2]}" },
+	};
+	for (size_t i = 0; i < sizeof(steps) / sizeof(steps[0]); i++){
+		switch (i) {
+		case 2: hum = 51; hum_ver = ++clock; break;
+		case 3: arr_ver = ++clock; break;
+		}
+
+		size_t l = json_generate_delta(result, tjs, MAXLEN, steps[i].since);
+		if (l != strlen(steps[i].expected) || strcmp(result, steps[i].expected)){
+			fprintf(stderr, "\nFAILED: %s, step %zu\n", test, i);
+			fprintf(stderr, "Expected : %s\n", steps[i].expected);
+			fprintf(stderr, "Generated: %s\n", result);
+			err = 1;
+		}
+	}
+
+	/* Cached generation only looks at the version */
+	struct json_cache cache = { .len = 0 };
+	json_generate_cached(result, tjs, MAXLEN, &cache);
+	temp = 21;
+	json_generate_cached(result, tjs, MAXLEN, &cache);
+	temp_ver = ++clock;
+	json_generate_cached(result, tjs, MAXLEN, &cache);
+	if (cache.hits != 1 || cache.misses != 2 || !strstr(result, "\"temp\":21"))
+		err = 1;
+
+	return err;
+}
+
+static int
+test_part(void)
+{
+	char expected[MAXLEN];
+	char *test = "test_part";
+	char buf[64];
+
+	tell_single_test(test);
+
+	const struct to_json *tjs = stream_test_json();
+	size_t l = json_generate(expected, tjs, MAXLEN);
+	assert(l);
+
+	int err = 0;
+	for (size_t len = 24; len <= sizeof(buf); len += 5){
+		char result[MAXLEN];
+		size_t offset = 0;
+		size_t n;
+		while ((n = json_generate_part(buf, tjs, len, offset))){
+			if (n >= len || strlen(buf) != n || offset + n >= MAXLEN)
+				break;
+			memcpy(result + offset, buf, n);
+			offset += n;
+		}
+		result[offset] = '\0';
+		if (n || offset != l || strcmp(result, expected)){
+			fprintf(stderr, "\nFAILED: %s\n", test);
+			fprintf(stderr, "Expected : %s\n", expected);
+			fprintf(stderr, "Generated: %s, buffer %zu\n", result, len);
+			err = 1;
+		}
+	}
+
+	return err;
+}
+
+static int
+read_all(const struct to_json *tjs, char *result, size_t len)
+{
+	char buf[64];
+	struct json_reader r;
+	json_reader_init(&r, tjs);
+
+	size_t offset = 0;
+	size_t n;
+	while ((n = json_reader_next(&r, buf, len))){
+		if (n >= len || strlen(buf) != n || offset + n >= MAXLEN)
+			return 1;
+		memcpy(result + offset, buf, n);
+		offset += n;
+	}
+	result[offset] = '\0';
+	return 0;
+}
+
+static int
+test_reader(void)
+{
+	char expected[MAXLEN];
+	char *test = "test_reader";
+
+	tell_single_test(test);
+
+	/* Deeper than the levels saved by the reader */
+	enum { LEVELS = JSON_READER_DEPTH + 4 };
+	static const int arr[] = { 1, 22, 333 };
+	static const size_t cnt = 3;
+	struct to_json nested[LEVELS][3];
+	for (int i = 0; i < LEVELS; i++){
+		nested[i][0] = (struct to_json){ .name = "a", .value = arr, .count = &cnt,
+			.vtype = t_to_int, .stype = t_to_object, };
+		nested[i][1] = (struct to_json){ .name = "next", .value = i + 1 < LEVELS ? nested[i + 1] : NULL,
+			.vtype = t_to_object, };
+		nested[i][2] = (struct to_json){ NULL };
+	}
+
+	const struct to_json *docs[] = { stream_test_json(), nested[0] };
+
+	int err = 0;
+	for (size_t d = 0; d < sizeof(docs) / sizeof(docs[0]); d++){
+		size_t l = json_generate(expected, docs[d], MAXLEN);
+		assert(l);
+		for (size_t len = 40; len <= 64; len += 3){
+			char result[MAXLEN];
+			if (read_all(docs[d], result, len) || strcmp(result, expected)){
+				fprintf(stderr, "\nFAILED: %s\n", test);
+				fprintf(stderr, "Expected : %s\n", expected);
+				fprintf(stderr, "Generated: %s, buffer %zu\n", result, len);
+				err = 1;
+			}
+		}
+	}
+
+	/* A number which does not fit into the buffer is an error, not the end */
+	static const int one = 1;
+	static const long long min = LLONG_MIN;
+	const struct to_json tjs[] = {
+		{ .name = "a", .value = &one, .vtype = t_to_int, .stype = t_to_object, },
+		{ .name = "b", .value = &min, .vtype = t_to_longlong, },
+		{ NULL }
+	};
+	char buf[12];
+	struct json_reader r;
+	json_reader_init(&r, tjs);
+	size_t n, offset = 0;
+	while ((n = json_reader_next(&r, buf, sizeof(buf))) && n != (size_t)-1)
+		offset += n;
+	size_t m = 0;
+	for (size_t o = 0; (m = json_generate_part(buf, tjs, sizeof(buf), o))
+			&& m != (size_t)-1; o += m)
+		;
+	if (n != (size_t)-1 || m != (size_t)-1 || !offset){
+		fprintf(stderr, "\nFAILED: %s, number split\n", test);
+		err = 1;
+	}
+
+	return err;
+}
+
+static int
+test_writer(void)
+{
+	char *test = "test_writer";
+
+	tell_single_test(test);
+
+	enum { NBUFS = 4, BUF_SIZE = 12, DOCS = 20 };
+	static char bufs[NBUFS][BUF_SIZE];
+	int n;
+	const struct to_json tjs[] = {
+		{ .name = "n", .value = &n, .vtype = t_to_int, .stype = t_to_object, },
+		{ NULL }
+	};
+
+	int err = 0;
+	for (unsigned flags = 0; flags <= json_writer_no_uring; flags++){
+		char expected[MAXLEN] = "";
+		char result[MAXLEN];
+		struct json_writer w;
+		int p[2];
+		FILE *f = tmpfile();
+		assert(f && !pipe(p));
+		assert(!json_writer_init(&w, bufs[0], BUF_SIZE, NBUFS, flags));
+
+		/* In order on a stream */
+		size_t l = 0;
+		for (n = 0; n < DOCS; n++){
+			l += json_generate(expected + l, tjs, MAXLEN - l);
+			err |= json_writer_write(&w, p[1], -1, tjs);
+		}
+		err |= json_writer_flush(&w);
+		err |= read(p[0], result, MAXLEN) != (ssize_t)l;
+		result[l] = '\0';
+		err |= strcmp(result, expected) != 0;
+
+		/* At offsets in reverse order, each document has 8 bytes */
+		for (n = DOCS + 9; n >= 10; n--)
+			err |= json_writer_write(&w, fileno(f), (n - 10) * 8, tjs);
+		err |= json_writer_flush(&w);
+		err |= pread(fileno(f), result, MAXLEN, 0) != 8 * DOCS;
+		result[8 * DOCS] = '\0';
+		l = 0;
+		for (n = 10; n < DOCS + 10; n++)
+			l += json_generate(expected + l, tjs, MAXLEN - l);
+		err |= strcmp(result, expected) != 0;
+
+		n = INT_MIN;
+		err |= json_writer_write(&w, p[1], -1, tjs) != -1 || errno != ENOBUFS;
+
+		json_writer_close(&w);
+		close(p[0]);
+		close(p[1]);
+		fclose(f);
+		if (err){
+			fprintf(stderr, "\nFAILED: %s, flags %u\n", test, flags);
+			fprintf(stderr, "Expected : %s\n", expected);
+			fprintf(stderr, "Generated: %s\n", result);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static ssize_t
+read_batch(int fd, char *result)
+{
+	ssize_t n = recv(fd, result, MAXLEN - 1, MSG_DONTWAIT);
+	result[n > 0 ? n : 0] = '\0';
+	return n;
+}
+
+static int
+test_batch(void)
+{
+	char *test = "test_batch";
+
+	tell_single_test(test);
+
+	char buf[32];
+	char result[MAXLEN];
+	int n = 1;
+	const struct to_json tjs[] = {
+		{ .name = "n", .value = &n, .vtype = t_to_int, .stype = t_to_object, },
+		{ NULL }
+	};
+	int sv[2];
+	assert(!socketpair(AF_UNIX, SOCK_STREAM, 0, sv));
+
+	int err = 0;
+	struct json_batch b = { .fd = sv[0], .buf = buf, .size = sizeof(buf),
+		.delim = "\n", .max_count = 3, };
+
+	/* Count */
+	err |= json_batch_add(&b, tjs) | json_batch_add(&b, tjs);
+	err |= read_batch(sv[1], result) != -1;
+	err |= json_batch_add(&b, tjs);
+	read_batch(sv[1], result);
+	err |= strcmp(result, "{\"n\":1}\n{\"n\":1}\n{\"n\":1}\n") != 0;
+
+	/* Full buffer */
+	b.max_count = 0;
+	for (n = 10; n < 14; n++)
+		err |= json_batch_add(&b, tjs);
+	read_batch(sv[1], result);
+	err |= strcmp(result, "{\"n\":10}\n{\"n\":11}\n{\"n\":12}\n") != 0;
+
+	/* Length */
+	b.max_len = 18;
+	err |= json_batch_add(&b, tjs);
+	read_batch(sv[1], result);
+	err |= strcmp(result, "{\"n\":13}\n{\"n\":14}\n") != 0;
+
+	/* Deadline and explicit flush */
+	int timeout;
+	b.max_delay_us = 2000;
+	err |= json_batch_add(&b, tjs) | json_batch_poll(&b, &timeout);
+	err |= timeout < 1 || timeout > 2 || b.count != 1;
+	nanosleep(&(struct timespec){ .tv_nsec = 3000000 }, NULL);
+	err |= json_batch_poll(&b, &timeout) || timeout != -1 || b.count;
+	err |= json_batch_add(&b, tjs) | json_batch_flush(&b);
+	read_batch(sv[1], result);
+	err |= strcmp(result, "{\"n\":14}\n{\"n\":14}\n") != 0;
+
+	/* Too long for the buffer */
+	n = INT_MIN;
+	b.size = 16;
+	err |= json_batch_add(&b, tjs) != -1 || errno != ENOBUFS;
+
+	/* Full non-blocking socket, documents which were not added are retried */
+	enum { DOCS = 20000 };
+	static char received[DOCS * 16];
+	size_t rlen = 0;
+	int full[2];
+	int sndbuf = 4096;
+	assert(!socketpair(AF_UNIX, SOCK_STREAM, 0, full));
+	setsockopt(full[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+	fcntl(full[0], F_SETFL, O_NONBLOCK);
+	b = (struct json_batch){ .fd = full[0], .buf = buf, .size = sizeof(buf),
+		.delim = "\n", .max_count = 2, };
+	unsigned again = 0;
+	for (n = 0; n < DOCS; ){
+		if (!json_batch_add(&b, tjs)){
+			n++;
+			continue;
+		}
+		err |= errno != EAGAIN;
+		again++;
+		ssize_t r;
+		while ((r = recv(full[1], received + rlen, sizeof(received) - rlen,
+						MSG_DONTWAIT)) > 0)
+			rlen += (size_t)r;
+	}
+	for (int ret = -1; ret && !err; ){
+		ret = json_batch_flush(&b);
+		err |= ret && errno != EAGAIN;
+		ssize_t r;
+		while ((r = recv(full[1], received + rlen, sizeof(received) - rlen,
+						MSG_DONTWAIT)) > 0)
+			rlen += (size_t)r;
+	}
+	err |= !again;
+	size_t expected_len = 0;
+	for (n = 0; n < DOCS && expected_len < rlen; n++){
+		char line[16];
+		size_t l = (size_t)snprintf(line, sizeof(line), "{\"n\":%d}\n", n);
+		err |= memcmp(received + expected_len, line, l) != 0;
+		expected_len += l;
+	}
+	err |= n != DOCS || expected_len != rlen;
+	close(full[0]);
+	close(full[1]);
+
+	/* Not a socket and no delimiter */
+	int p[2];
+	assert(!pipe(p));
+	b = (struct json_batch){ .fd = p[1], .buf = buf, .size = sizeof(buf), };
+	n = 1;
+	err |= json_batch_add(&b, tjs) | json_batch_add(&b, tjs) | json_batch_flush(&b);
+	err |= read(p[0], result, MAXLEN) != 14;
+	result[14] = '\0';
+	err |= strcmp(result, "{\"n\":1}{\"n\":1}") != 0;
+
+	close(p[0]);
+	close(p[1]);
+	close(sv[0]);
+	close(sv[1]);
+	if (err){
+		fprintf(stderr, "\nFAILED: %s\n", test);
+		fprintf(stderr, "Generated: %s\n", result);
+		return 1;
+	}
+	return 0;
+}
+
 static int
 test_array_primitive_all_int_types(void)
 {
@@ -889,7 +2057,61 @@ exec_test(int i)
 	case 25:
 		return test_c_array_hex();
 		break;
-#define MAXTEST 26
+	case 26:
+		return test_object_map();
+		break;
+	case 27:
+		return test_primitive_map_empty();
+		break;
+	case 28:
+		return test_truncated();
+		break;
+	case 29:
+		return test_prioritized();
+		break;
+	case 30:
+		return test_split();
+		break;
+	case 31:
+		return test_generate_size();
+		break;
+	case 32:
+		return test_framed();
+		break;
+	case 33:
+		return test_stream();
+		break;
+	case 34:
+		return test_chunked_loopback();
+		break;
+	case 35:
+		return test_digest();
+		break;
+	case 36:
+		return test_cached();
+		break;
+	case 37:
+		return test_const();
+		break;
+	case 38:
+		return test_delta();
+		break;
+	case 39:
+		return test_part();
+		break;
+	case 40:
+		return test_reader();
+		break;
+	case 41:
+		return test_writer();
+		break;
+	case 42:
+		return test_batch();
+		break;
+	case 43:
+		return test_stream_nested();
+		break;
+#define MAXTEST 44
 	case MAXTEST:
 		return 0;
 	default:
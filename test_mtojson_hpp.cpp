@@ -0,0 +1,348 @@
+/*
+ * Tests for mtojson.hpp
+ *
+ * Exit status is the count of failed tests, run with -v to print the name of
+ * every test.
+ */
+
+/*
+ * SPDX-License-Identifier: BSD-2-Clause
+ * This file is Copyright (c) 2020, 2021 by Rene Kita
+ */
+
+#include "mtojson.hpp"
+
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <list>
+#include <map>
+#include <unordered_map>
+
+struct point {
+	int x;
+	int y;
+};
+MTOJSON_NAMES(point, "x", "y");
+
+struct reading {
+	point pos;
+	unsigned short values[2];
+	bool ok;
+	char label[8];
+};
+MTOJSON_NAMES(reading, "pos", "values", "ok", "label");
+
+/* Without names */
+struct pair {
+	long a;
+	point b;
+};
+
+namespace {
+
+enum { MAXLEN = 512 };
+
+int verbose = 0;
+
+int
+check(const char *test, const char *expected, const char *result, std::size_t len)
+{
+	if (verbose)
+		std::printf("Running test: %-35s\n", test);
+
+	if (len == std::strlen(expected) && !std::strcmp(result, expected))
+		return 0;
+
+	std::fprintf(stderr, "\nFAILED: %s\n", test);
+	std::fprintf(stderr, "Expected : %s\n", expected);
+	std::fprintf(stderr, "Generated: %s\n", result);
+	return 1;
+}
+
+const long g_long = -1234567890L;
+const int g_arr[] = { 1, 2, 3 };
+constexpr auto g_tjs = json::object(json::field("long", g_long),
+		json::field("arr", g_arr));
+
+static_assert(g_tjs[0].vtype == t_to_long && g_tjs[0].stype == t_to_object);
+static_assert(g_tjs[1].vtype == t_to_int && *g_tjs[1].count == 3);
+static_assert(g_tjs[2].name == nullptr);
+
+int
+test_constexpr_descriptor()
+{
+	char result[MAXLEN];
+	std::size_t l = json::generate(result, g_tjs);
+	return check(__func__, "{\"long\":-1234567890,\"arr\":[1,2,3]}", result, l);
+}
+
+int
+test_deduced_types()
+{
+	bool b = true;
+	signed char i8 = -8;
+	short i16 = -16;
+	unsigned long long u64 = 18446744073709551615ULL;
+	unsigned char u8s[] = { 0, 255 };
+	std::array<unsigned short, 2> u16s = { { 1, 65535 } };
+	const char *str = "a\"b";
+	char text[] = "text";
+
+	const auto inner = json::object(json::field("b", b), json::field("u8s", u8s));
+	const auto elements = json::array(json::value(i8), json::value(str));
+	const auto tjs = json::object(
+			json::field("i16", i16),
+			json::field("u64", u64),
+			json::field("u16s", u16s),
+			json::field("str", str),
+			json::field("text", text),
+			json::field("literal", "lit"),
+			json::field("inner", inner),
+			json::field("elements", elements));
+
+	std::array<char, MAXLEN> result;
+	std::size_t l = json::generate(result, tjs);
+	return check(__func__, "{\"i16\":-16,\"u64\":18446744073709551615,"
+			"\"u16s\":[1,65535],\"str\":\"a\\\"b\",\"text\":\"text\","
+			"\"literal\":\"lit\",\"inner\":{\"b\":true,\"u8s\":[0,255]},"
+			"\"elements\":[-8,\"a\\\"b\"]}", result.data(), l);
+}
+
+int
+test_primitive()
+{
+	unsigned n = 42;
+	char result[MAXLEN];
+	std::size_t l = json::generate(result, json::primitive(n));
+	return check(__func__, "42", result, l);
+}
+
+int
+test_static_object()
+{
+	bool b = false;
+	signed char i8 = -128;
+	unsigned long long u64 = 18446744073709551615ULL;
+	char str[8] = "a\\b";
+	const int arr[] = { -1, 0, 1 };
+	std::array<short, 2> shorts = { { -32768, 32767 } };
+
+	const auto inner = json::static_object(json::key<"b">(b));
+	const auto doc = json::static_object(
+			json::key<"i8">(i8),
+			json::key<"u64">(u64),
+			json::key<"q\"k">(str),
+			json::key<"arr">(arr),
+			json::key<"shorts">(shorts),
+			json::key<"inner">(inner),
+			json::key<"empty">(json::static_object()));
+
+	static_assert(json::max_size<decltype(inner)> == 11);
+	json::buffer<decltype(doc)> result;
+	std::size_t l = json::serialize(result, doc);
+	int err = check(__func__, "{\"i8\":-128,\"u64\":18446744073709551615,"
+			"\"q\\\"k\":\"a\\\\b\",\"arr\":[-1,0,1],"
+			"\"shorts\":[-32768,32767],\"inner\":{\"b\":false},\"empty\":{}}",
+			result.data(), l);
+
+	/* The bound is reached with the longest values */
+	char longest[4] = "\"\"\"";
+	const auto full = json::static_object(json::key<"s">(longest), json::key<"n">(i8));
+	json::buffer<decltype(full)> buf;
+	l = json::serialize(buf, full);
+	return err | check(__func__, "{\"s\":\"\\\"\\\"\\\"\",\"n\":-128}", buf.data(), l)
+		| (l != json::max_size<decltype(full)>);
+}
+
+int
+test_reflection()
+{
+	static_assert(json::detail::field_count<pair>() == 2);
+	static_assert(json::max_size<point> == 33);
+
+	const reading r = { { -1, 2 }, { 3, 4 }, true, "r\"1" };
+	json::buffer<reading> result;
+	std::size_t l = json::serialize(result, r);
+	int err = check(__func__, "{\"pos\":{\"x\":-1,\"y\":2},\"values\":[3,4],"
+			"\"ok\":true,\"label\":\"r\\\"1\"}", result.data(), l);
+
+	const pair p = { 5, { 6, 7 } };
+	const auto doc = json::static_object(json::key<"pair">(p));
+	json::buffer<decltype(doc)> buf;
+	l = json::serialize(buf, doc);
+	return err | check(__func__, "{\"pair\":[5,{\"x\":6,\"y\":7}]}", buf.data(), l);
+}
+
+int
+test_stl()
+{
+	std::vector<int> vec = { 1, -2, 3 };
+	std::vector<bool> bits = { true, false };
+	const long arr[] = { 4, 5 };
+	std::span<const long, 2> fixed(arr);
+	std::string str = "s\"tr";
+	std::optional<unsigned> none;
+	std::optional<unsigned> some = 7;
+	std::map<std::string, std::vector<point>> map = {
+		{ "a", { { 1, 2 } } },
+		{ "b", {} },
+	};
+	std::unordered_map<std::string_view, int> empty;
+	const char *cstr = "c";
+	const char *nul = nullptr;
+
+	const auto doc = json::static_object(
+			json::key<"vec">(vec),
+			json::key<"bits">(bits),
+			json::key<"span">(std::span<const int>(vec).subspan(1)),
+			json::key<"fixed">(fixed),
+			json::key<"str">(str),
+			json::key<"view">(std::string_view(str).substr(2)),
+			json::key<"cstr">(cstr),
+			json::key<"nul">(nul),
+			json::key<"none">(none),
+			json::key<"some">(some),
+			json::key<"map">(map),
+			json::key<"empty">(empty));
+	const char *expected = "{\"vec\":[1,-2,3],\"bits\":[true,false],"
+			"\"span\":[-2,3],\"fixed\":[4,5],\"str\":\"s\\\"tr\","
+			"\"view\":\"tr\",\"cstr\":\"c\",\"nul\":null,\"none\":null,"
+			"\"some\":7,"
+			"\"map\":{\"a\":[{\"x\":1,\"y\":2}],\"b\":[]},\"empty\":{}}";
+
+	static_assert(json::max_size<std::span<const long, 2>> == 43);
+	static_assert(json::max_size<std::optional<bool>> == 5);
+	static_assert(!json::detail::bounded<decltype(doc)>);
+
+	char result[MAXLEN];
+	std::size_t len = std::strlen(expected);
+	int err = json::size(doc) != len;
+	err |= json::serialize(result, len, doc) != 0;
+	std::size_t l = json::serialize(result, len + 1, doc);
+	return err | check(__func__, expected, result, l);
+}
+
+int
+test_sinks()
+{
+	const point p = { 1, -2 };
+	std::vector<int> vec = { 3, 4 };
+	const auto doc = json::static_object(json::key<"p">(p), json::key<"vec">(vec));
+	const char *expected = "{\"p\":{\"x\":1,\"y\":-2},\"vec\":[3,4]}";
+
+	int err = 0;
+	std::string s = "prefix";
+	err |= json::append(s, doc) != std::strlen(expected);
+	err |= check(__func__, (std::string("prefix") + expected).c_str(), s.c_str(), s.size());
+
+	std::vector<char> v;
+	json::serialize_to(std::back_inserter(v), doc);
+	v.push_back('\0');
+	err |= check(__func__, expected, v.data(), v.size() - 1);
+
+	std::string t = "x";
+	json::serialize_to(std::back_inserter(t), p);
+	err |= check(__func__, "x{\"x\":1,\"y\":-2}", t.c_str(), t.size());
+
+	/* Generic iterators, bounded and unbounded */
+	std::list<char> l;
+	json::serialize_to(json::serialize_to(std::back_inserter(l), p), doc);
+	std::string ls(l.begin(), l.end());
+	err |= check(__func__, (std::string("{\"x\":1,\"y\":-2}") + expected).c_str(),
+			ls.c_str(), ls.size());
+
+	char buf[MAXLEN];
+	*json::serialize_to(buf, doc) = '\0';
+	err |= check(__func__, expected, buf, std::strlen(buf));
+
+	std::string str = json::to_string(doc);
+	return err | check(__func__, expected, str.c_str(), str.size());
+}
+
+int
+test_chunks()
+{
+	char str[100];
+	std::memset(str, 'x', sizeof(str) - 1);
+	str[sizeof(str) - 1] = '\0';
+	const int arr[] = { 1, -22, 333, -4444 };
+	const auto inner = json::object(json::field("arr", arr), json::field("str", str));
+	const auto tjs = json::object(json::field("a", inner), json::field("b", inner));
+
+	char expected[MAXLEN];
+	json::generate(expected, tjs);
+
+	int err = 0;
+	for (std::size_t len : { 16, 33, 64 }){
+		std::vector<char> buf(len);
+		std::string result;
+		std::size_t n = 0;
+		for (std::string_view chunk : json::chunks(tjs.data(), buf)){
+			err |= chunk.size() >= len;
+			result += chunk;
+			n++;
+		}
+		err |= n < std::strlen(expected) / len;
+		err |= check(__func__, expected, result.c_str(), result.size());
+	}
+
+	/* Interleaved generators */
+	char b1[20], b2[30];
+	auto g1 = json::chunks(tjs.data(), b1);
+	auto g2 = json::chunks(tjs.data(), b2);
+	std::string r1, r2;
+	auto i1 = g1.begin();
+	auto i2 = g2.begin();
+	while (i1 != g1.end() || i2 != g2.end()){
+		if (i1 != g1.end()){
+			r1 += *i1;
+			++i1;
+		}
+		if (i2 != g2.end()){
+			r2 += *i2;
+			++i2;
+		}
+	}
+	err |= check(__func__, expected, r1.c_str(), r1.size());
+	err |= check(__func__, expected, r2.c_str(), r2.size());
+	err |= g1.failed() || g2.failed();
+
+	/* A number which does not fit into the buffer */
+	const long long min = LLONG_MIN;
+	const auto split = json::object(json::field("a", arr[0]), json::field("b", min));
+	char b3[12];
+	auto g3 = json::chunks(split.data(), b3);
+	std::string r3;
+	for (std::string_view chunk : g3)
+		r3 += chunk;
+	if (!g3.failed() || r3.empty()){
+		std::fprintf(stderr, "\nFAILED: %s, number split\n", __func__);
+		err = 1;
+	}
+	return err;
+}
+
+int (* const tests[])() = {
+	test_constexpr_descriptor,
+	test_deduced_types,
+	test_primitive,
+	test_static_object,
+	test_reflection,
+	test_stl,
+	test_sinks,
+	test_chunks,
+};
+
+} // namespace
+
+int
+main(int argc, char *argv[])
+{
+	verbose = argc > 1 && !std::strcmp(argv[1], "-v");
+
+	int failed = 0;
+	for (auto test : tests)
+		failed += test();
+	return failed;
+}